@@ -12,9 +12,49 @@ struct Super *super;//!< Address of super block in memroy.
 
 u_int nbitmap;		//!< Number of bitmap blocks.
 u_int *bitmap;		//!< Address of bitmap blocks mapped in memory.
+u_int nfree;		//!< Number of free blocks in the bitmap.
+static u_int bitmap_hint;	//!< Bitmap word the next allocation starts at.
 
-void file_flush(struct File*);
+int file_flush(struct File*);
 int block_is_free(u_int);
+void write_block(u_int);
+void write_block_async(u_int);
+
+/** A slot of the block cache.
+ *
+ * Slots of the blocks in memory are chained on #bc_hash by block number.
+ * Free slots are chained on #bc_free through bc_next.
+ */
+struct Bcache {
+	u_int bc_blockno;	//!< Block held by the slot.
+	u_short bc_next;	//!< Index + 1 of the next slot on the chain, 0 ends it.
+	u_char bc_inuse;	//!< Whether the slot holds a block.
+	u_char bc_ref;		//!< Used since the clock hand last passed it.
+	u_char bc_ra;		//!< Read ahead and not used yet.
+	u_int bc_pin;		//!< Pin count, pinned blocks are never evicted.
+};
+
+static struct Bcache bcache[NBCACHE];
+static u_short bc_hash[NBCACHE];	//!< Index + 1 of the first slot of each chain.
+static u_short bc_free;			//!< Index + 1 of the first free slot.
+static u_int bc_nused;			//!< Slots handed out at least once.
+static u_int bc_hand;			//!< Clock hand.
+struct Bcstat bcstat;			//!< Block cache counters.
+
+/** A page of file data that has no disk block yet.
+ *
+ * The page of slot n is mapped at `DALLOCVA + (n * BY2PG)`.
+ */
+struct Dalloc {
+	struct File *d_file;	//!< File the page belongs to, 0 if the slot is free.
+	u_int d_fileb;		//!< Block of the file it holds.
+};
+
+static struct Dalloc dalloc[NDALLOC];
+
+static u_int meta_block[NMETA];	//!< Blocks holding File structures changed in memory only.
+static u_int meta_n;		//!< Number of blocks in meta_block.
+static int dindex_failed;	//!< A directory index build failed, see dir_index_build().
 
 /** Return the virtual address of the disk block specified by blockno.
  *
@@ -63,19 +103,18 @@ block_is_mapped(u_int blockno)
 
 /** Check whether a page in memory is dirty.
  *
- * \warning The function is not implemented actually.
+ * Cache pages are mapped with #PTE_DTRACK, so the first write to one sets
+ * #PTE_D in our page table (see page_fault_handler()).
  *
  * @param[in] va Virtual address to be checked.
  */
 u_int
 va_is_dirty(u_int va)
 {
-	return 0;//we have no PTE_D//(* vpt)[VPN(va)]&PTE_D;
+	return (* vpt)[VPN(va)]&PTE_D;
 }
 
 /** Check whether a block in memory is dirty.
- *
- * \warning The function is not implemented actually.
  *
  * @param[in] blockno Block number of the block to be checked.
  */
@@ -88,6 +127,158 @@ block_is_dirty(u_int blockno)
 	return va_is_mapped(va) && va_is_dirty(va);
 }
 
+/** Find the cache slot of a block, `0` if the block is not in memory.
+ */
+static struct Bcache *
+bcache_lookup(u_int blockno)
+{
+	u_int i;
+
+	for (i = bc_hash[blockno % NBCACHE]; i; i = bcache[i-1].bc_next)
+		if (bcache[i-1].bc_blockno == blockno)
+			return &bcache[i-1];
+	return 0;
+}
+
+/** Take the slot of a block off its chain and put it on the free list.
+ */
+static void
+bcache_drop(struct Bcache *b)
+{
+	u_short *link;
+
+	for (link = &bc_hash[b->bc_blockno % NBCACHE]; *link; link = &bcache[*link-1].bc_next)
+		if (&bcache[*link-1] == b) {
+			*link = b->bc_next;
+			break;
+		}
+	b->bc_inuse = 0;
+	b->bc_pin = 0;
+	b->bc_next = bc_free;
+	bc_free = b - bcache + 1;
+}
+
+/** Evict one block to make room in the cache.
+ *
+ * The clock hand sweeps the slots, giving blocks used since its last pass
+ * a second chance. Pinned blocks, and blocks a client has mapped too (the
+ * client's page would stop being the cached one), are skipped. The victim
+ * is written back if dirty and unmapped.
+ *
+ * Return `0` on success, `-#E_NO_MEM` if every block is in use.
+ */
+static int
+bcache_evict(void)
+{
+	struct Bcache *b;
+	u_int n, va;
+	int r;
+
+	for (n = 0; n < 2*NBCACHE; n++) {
+		b = &bcache[bc_hand];
+		bc_hand = (bc_hand + 1) % NBCACHE;
+		if (!b->bc_inuse || b->bc_pin)
+			continue;
+		va = diskaddr(b->bc_blockno);
+		if (pageref((void*)va) > 1)
+			continue;
+		if (b->bc_ref) {
+			b->bc_ref = 0;
+			continue;
+		}
+
+		if (va_is_dirty(va)) {
+			write_block(b->bc_blockno);
+			bcstat.bs_writebacks++;
+		}
+		if (b->bc_ra)
+			bcstat.bs_rawaste++;
+		if ((r = syscall_mem_unmap(0, va)) < 0)
+			return r;
+		bcache_drop(b);
+		bcstat.bs_evicts++;
+		return 0;
+	}
+	return -E_NO_MEM;
+}
+
+/** Give a block a slot in the cache, evicting another one if needed.
+ *
+ * The caller then maps the block at diskaddr(blockno).
+ */
+static int
+bcache_insert(u_int blockno)
+{
+	struct Bcache *b;
+	int r;
+
+	if (!bc_free && bc_nused == NBCACHE && (r = bcache_evict()) < 0)
+		return r;
+	if (bc_free) {
+		b = &bcache[bc_free-1];
+		bc_free = b->bc_next;
+	} else
+		b = &bcache[bc_nused++];
+
+	b->bc_blockno = blockno;
+	b->bc_inuse = 1;
+	b->bc_ref = 1;
+	b->bc_ra = 0;
+	b->bc_pin = 0;
+	b->bc_next = bc_hash[blockno % NBCACHE];
+	bc_hash[blockno % NBCACHE] = b - bcache + 1;
+	return 0;
+}
+
+/** Load a block that is not in memory from disk into the cache.
+ *
+ * Return its slot, or `0` and set *pr to an error code.
+ */
+static struct Bcache *
+bcache_load(u_int blockno, int *pr)
+{
+	u_int va;
+
+	va = diskaddr(blockno);
+	if ((*pr = bcache_insert(blockno)) < 0)
+		return 0;
+	if ((*pr = syscall_mem_alloc(0, va, PTE_V|PTE_DTRACK|PTE_LIBRARY)) < 0) {
+		bcache_drop(bcache_lookup(blockno));
+		return 0;
+	}
+	ide_read(1, blockno*SECT2BLK, (void*)va, SECT2BLK);
+	return bcache_lookup(blockno);
+}
+
+/** Keep the block holding `va` in memory until block_unpin().
+ *
+ * For blocks used through plain pointers, such as the super block, the
+ * bitmap and the File structures of open files.
+ *
+ * @param[in] va Address inside a cached block.
+ */
+void
+block_pin(void *va)
+{
+	struct Bcache *b;
+
+	if ((b = bcache_lookup(((u_int)va - DISKMAP) / BY2BLK)) != 0)
+		b->bc_pin++;
+}
+
+/** Undo one block_pin() of the block holding `va`.
+ *
+ * @param[in] va Address inside a cached block.
+ */
+void
+block_unpin(void *va)
+{
+	struct Bcache *b;
+
+	if ((b = bcache_lookup(((u_int)va - DISKMAP) / BY2BLK)) != 0 && b->bc_pin)
+		b->bc_pin--;
+}
+
 /** Allocate a page for some block in memory.
  *
  * If there is a page for the block, do nothing, otherwise, allocate a page via
@@ -98,9 +289,15 @@ block_is_dirty(u_int blockno)
 int
 map_block(u_int blockno)
 {
+	int r;
+
 	if (block_is_mapped(blockno))
 		return 0;
-	return syscall_mem_alloc(0, diskaddr(blockno), PTE_V|PTE_R);
+	if ((r = bcache_insert(blockno)) < 0)
+		return r;
+	if ((r = syscall_mem_alloc(0, diskaddr(blockno), PTE_V|PTE_DTRACK|PTE_LIBRARY)) < 0)
+		bcache_drop(bcache_lookup(blockno));
+	return r;
 }
 
 // Make sure a particular disk block is loaded into memory.
@@ -119,7 +316,8 @@ map_block(u_int blockno)
 /** Make sure a particular disk block is loaded into memory.
  *
  * If the block is currently in memory, do nothing, otherwise, load it from
- * disk into memory via ide_read().
+ * disk into memory via ide_read(). At most #NBCACHE blocks are kept in
+ * memory; to load one more, a block not used lately is evicted.
  *
  * If blk is not zero, set *blk to the address of the block in memory.
  *
@@ -145,6 +343,7 @@ read_block(u_int blockno, void **blk, u_int *isnew)
 {
 	int r;
 	u_int va;
+	struct Bcache *b;
 
 	if (super && blockno >= super->s_nblocks)
 		user_panic("reading non-existent block %08x\n", blockno);
@@ -155,20 +354,31 @@ read_block(u_int blockno, void **blk, u_int *isnew)
 	// Your code here
 	va = diskaddr(blockno);
 
-	if(blk) *blk = va;
 	if(block_is_mapped(blockno))	//the block is in memory
 	{
+		if((b = bcache_lookup(blockno)) != 0)
+		{
+			b->bc_ref = 1;
+			if(b->bc_ra)
+			{
+				b->bc_ra = 0;
+				bcstat.bs_rahits++;
+			}
+		}
+		bcstat.bs_hits++;
 		if(isnew)
 			*isnew = 0;
 	}
 	else				//the block is not in memory
 	{
+//		writef("fs.c:read_block(): before ide_read() blockno:%x va:%x\n",blockno,va);
+		if(bcache_load(blockno, &r) == 0)
+			return r;
+		bcstat.bs_misses++;
 		if(isnew)
 			*isnew = 1;
-		syscall_mem_alloc(0, va, PTE_V|PTE_R);
-//		writef("fs.c:read_block(): before ide_read() blockno:%x va:%x\n",blockno,va);
-		ide_read(1, blockno*SECT2BLK, va, SECT2BLK);
 	}
+	if(blk) *blk = va;
 //	user_panic("read_block not implemented");
 //	writef("fs.c:read_block(): end !\n");
 	return 0;
@@ -195,10 +405,30 @@ write_block(u_int blockno)
 	va = diskaddr(blockno);
 //	writef("writeBLK():  blockno:%x  va:%x\n", blockno,va);
 	ide_write(1, blockno*SECT2BLK, va, SECT2BLK);
-	syscall_mem_map(0, va, 0, va, (PTE_V|PTE_R|PTE_LIBRARY));
+	// map it clean again so that the next write is caught
+	syscall_mem_map(0, va, 0, va, (PTE_V|PTE_DTRACK|PTE_LIBRARY));
 //	user_panic("write_block not implemented");
 }
 
+/** Queue the contents of the block to be written out to disk, see
+ * ide_write_async(), and map it clean again at once.
+ *
+ * \pre The block must have been mapped in memory.
+ *
+ * @param[in] blockno Block number of a block.
+ */
+void
+write_block_async(u_int blockno)
+{
+	u_int va;
+
+	if (!block_is_mapped(blockno))
+		user_panic("write unmapped block %08x", blockno);
+	va = diskaddr(blockno);
+	syscall_mem_map(0, va, 0, va, (PTE_V|PTE_DTRACK|PTE_LIBRARY));
+	ide_write_async(DISKNO, blockno*SECT2BLK, (void*)va, SECT2BLK);
+}
+
 // Make sure this block is unmapped.
 /** Unmap a block from memory. 
  *
@@ -214,15 +444,20 @@ void
 unmap_block(u_int blockno)
 {
 	int r;
+	struct Bcache *b;
 
 	if(!block_is_mapped(blockno))
 		return;
+	// a queued write may still read the block
+	ide_flush();
 
 	user_assert(block_is_free(blockno) || !block_is_dirty(blockno));
 
 	if ((r = syscall_mem_unmap(0, diskaddr(blockno))) < 0)
 		user_panic("unmap_block: syscall_mem_unmap: %e", r);
 	user_assert(!block_is_mapped(blockno));
+	if ((b = bcache_lookup(blockno)) != 0)
+		bcache_drop(b);
 }
 
 // Check to see if the block bitmap indicates that block 'blockno' is free.
@@ -263,16 +498,39 @@ free_block(u_int blockno)
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		user_panic("attempt to free zero block");
+	if (!(bitmap[blockno / 32] & (1<<(blockno % 32))))
+		nfree++;
 	bitmap[blockno / 32] |= 1<<(blockno % 32);
 }
 
+/** Return the index of the lowest bit set in `w`, which must not be 0.
+ *
+ * The R3000 has no count-zeros instruction: isolate the bit and look its
+ * position up with a de Bruijn multiply.
+ */
+static int
+lowest_bit(u_int w)
+{
+	static const u_char debruijn[32] = {
+		0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+		31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+	};
+
+	return debruijn[((w & -w) * 0x077CB531U) >> 27];
+}
+
 // Search the bitmap for a free block and allocate it.
 // 
 // Return block number allocated on success, `-#E_NO_DISK` if we are out of blocks.
 /** Search the bitmap for a free block and allocate it.
  *
- * Return block number allocated and flush the bitmap out to disk on success,
- * `-#E_NO_DISK` if we are out of blocks.
+ * The search goes a word at a time, skipping words with no free block, and
+ * starts where the last allocation left off (next fit), wrapping around.
+ * The bitmap is only changed in memory; the dirty bitmap blocks reach the
+ * disk with bitmap_flush() or fs_sync().
+ *
+ * Return block number allocated on success, `-#E_NO_DISK` if we are out of
+ * blocks.
  */
 int
 alloc_block_num(void)
@@ -280,19 +538,62 @@ alloc_block_num(void)
 	// Your code here.
 	//user_panic("alloc_block_num not implemented");
 	int blockno;
-
-	for(blockno = 3;blockno < super->s_nblocks; blockno++)
-	{
-		if (bitmap[blockno / 32] & (1 << (blockno % 32)))	//the block is free 
-		{
-			bitmap[blockno / 32] &= ~(1 << (blockno % 32));
-			write_block(blockno / BIT2BLK);
-			return blockno;
+	u_int i, n, nwords;
+
+	if (nfree == 0)
+		return -E_NO_DISK;
+	nwords = (super->s_nblocks + 31) / 32;
+	if (bitmap_hint >= nwords)
+		bitmap_hint = 0;
+	for (i = bitmap_hint, n = 0; n < nwords; n++) {
+		if (bitmap[i]) {	//some block of the word is free
+			blockno = i * 32 + lowest_bit(bitmap[i]);
+			if (blockno < super->s_nblocks) {
+				bitmap[i] &= ~(1 << (blockno % 32));
+				bitmap_hint = i;
+				nfree--;
+				return blockno;
+			}
 		}
+		if (++i == nwords)
+			i = 0;
 	}
 	return -E_NO_DISK;
 }
 
+/** Allocate a particular block if it is free, so that a file can grow
+ * in place.
+ *
+ * Return the block number on success, `-#E_NO_DISK` if the block is in use.
+ */
+static int
+alloc_block_at(u_int blockno)
+{
+	int r;
+
+	if (blockno >= super->s_nblocks || !block_is_free(blockno))
+		return -E_NO_DISK;
+	bitmap[blockno / 32] &= ~(1 << (blockno % 32));
+	nfree--;
+	if ((r = map_block(blockno)) < 0) {
+		free_block(blockno);
+		return r;
+	}
+	return blockno;
+}
+
+/** Write the dirty bitmap blocks out to disk.
+ */
+void
+bitmap_flush(void)
+{
+	u_int i;
+
+	for (i = 0; i < nbitmap; i++)
+		if (block_is_dirty(i + 2))
+			write_block_async(i + 2);
+}
+
 // Allocate a block -- first find a free block in the bitmap,
 // then map it into memory.
 /** Allocate a block.
@@ -369,7 +670,11 @@ read_bitmap(void)
 //writef("nbitmap = %d,	nblocks = %d\n",nbitmap,super->s_nblocks);
 	nbitmap = (super->s_nblocks + BIT2BLK - 1) / BIT2BLK;
 	for(i = 0; i < nbitmap; i++)
-		read_block(i + 2, blk, 0);
+	{
+		if((r = read_block(i + 2, &blk, 0)) < 0)
+			user_panic("cannot read bitmap: %e", r);
+		block_pin(blk);
+	}
 	bitmap = diskaddr(2);
 	// Make sure the reserved and root blocks are marked in-use
 	user_assert(!block_is_free(0));
@@ -378,6 +683,11 @@ read_bitmap(void)
 		user_assert(!block_is_free(i+2));
 	user_assert(bitmap);
 
+	nfree = 0;
+	for(i = 0; i < super->s_nblocks; i++)
+		if(block_is_free(i))
+			nfree++;
+
 //	writef("read_bitmap is good\n");
 }
 
@@ -400,10 +710,10 @@ check_write_block(void)
 	strcpy((char*)diskaddr(1), "OOPS!\n");
 	write_block(1);//user_panic("#########################");
 	user_assert(block_is_mapped(1));
-	//^^^user_assert(!va_is_dirty(diskaddr(1)));
+	user_assert(!va_is_dirty(diskaddr(1)));
 	
 	// clear it out
-	syscall_mem_unmap(0, diskaddr(1));
+	unmap_block(1);
 	user_assert(!block_is_mapped(1));
 
 	// read it back in
@@ -415,6 +725,10 @@ check_write_block(void)
 	write_block(1);
 	super = (struct Super*)diskaddr(1);
 
+	// drop the backup, which must never reach the boot block
+	syscall_mem_map(0, diskaddr(0), 0, diskaddr(0), PTE_V|PTE_DTRACK|PTE_LIBRARY);
+	unmap_block(0);
+
 //	writef("write_block is good\n");
 }
 
@@ -427,6 +741,8 @@ fs_init(void)
 	read_super();
 	
 	check_write_block();
+	// the super block is used through a plain pointer; keep it cached
+	block_pin(super);
 	read_bitmap();
 }
 
@@ -440,8 +756,9 @@ fs_init(void)
  * When need to allocate an indirect block, if alloc is zero, return
  * `-#E_NOT_FOUND`, otherwise, allocate a block to it via alloc_block().
  *
- * For simplicity of OS lab, if the request filebno is greater than or equal to
- * NINDIRECT, return `-#E_INVAL`.
+ * Blocks from NINDIRECT on are reached through f_dindirect, which needs an
+ * indirect block allocated beneath it too. If filebno is past those, return
+ * `-#E_INVAL`.
  *
  * @param[in] f Pointer to the file.
  * @param[in] filebno Block number of the file to be located.
@@ -470,6 +787,32 @@ file_block_walk(struct File *f, u_int filebno, u_int **ppdiskbno, u_int alloc)
 			return r;
 		user_assert(blk != 0);
 		ptr = (u_int*)blk + filebno;
+	} else if (filebno - NINDIRECT < NDINDIRECT) {
+		filebno -= NINDIRECT;
+		if (f->f_dindirect == 0) {
+			if (alloc == 0)
+				return -E_NOT_FOUND;
+			if ((r = alloc_block()) < 0)
+				return r;
+			f->f_dindirect = r;
+		}
+		if ((r = read_block(f->f_dindirect, &blk, 0)) < 0)
+			return r;
+		ptr = (u_int*)blk + filebno / NINDIRECT;
+		if (*ptr == 0) {
+			if (alloc == 0)
+				return -E_NOT_FOUND;
+			// allocating may evict the double-indirect block
+			block_pin(blk);
+			r = alloc_block();
+			block_unpin(blk);
+			if (r < 0)
+				return r;
+			*ptr = r;
+		}
+		if ((r = read_block(*ptr, &blk, 0)) < 0)
+			return r;
+		ptr = (u_int*)blk + filebno % NINDIRECT;
 	} else
 		return -E_INVAL;
 
@@ -477,6 +820,242 @@ file_block_walk(struct File *f, u_int filebno, u_int **ppdiskbno, u_int alloc)
 	return 0;
 }
 
+/** Return the i'th extent slot of a file with #FFLAG_EXTENT.
+ *
+ * Slots past #NDEXTENT live in the extent block, which is allocated (and
+ * zeroed) if `alloc` is set. Return `0` if the slot does not exist.
+ */
+static struct Extent *
+extent_slot(struct File *f, u_int i, u_int alloc)
+{
+	void *blk;
+	int r;
+
+	if (i < NDEXTENT)
+		return (struct Extent*)f->f_direct + i;
+	if (i >= NDEXTENT + NIEXTENT)
+		return 0;
+	if (f->f_indirect == 0) {
+		if (alloc == 0 || (r = alloc_block()) < 0)
+			return 0;
+		f->f_indirect = r;
+		user_bzero((void*)diskaddr(r), BY2BLK);
+	}
+	if (read_block(f->f_indirect, &blk, 0) < 0)
+		return 0;
+	return (struct Extent*)blk + (i - NDEXTENT);
+}
+
+/** Find the disk block of block `filebno` of a file with #FFLAG_EXTENT.
+ *
+ * If the block has none and `alloc` is set, allocate one: right after the
+ * extent ending just before `filebno` if that block is free, growing the
+ * extent (and merging it with the next one when they meet), otherwise
+ * anywhere, in a new extent.
+ *
+ * Return `0` and set *diskbno on success, `-#E_NOT_FOUND` if the block is
+ * missing and `alloc` is zero, `-#E_NO_DISK` if the disk or the extent
+ * table is full.
+ */
+static int
+extent_map_block(struct File *f, u_int filebno, u_int *diskbno, u_int alloc)
+{
+	struct Extent *e, *prev, *next, *from, *to;
+	u_int i, n;
+	int r;
+
+	if (filebno > 0xffff)
+		return -E_INVAL;
+	// find the extent holding filebno, or where a new one would go
+	prev = 0;
+	for (i = 0; (e = extent_slot(f, i, 0)) != 0 && e->e_len; i++) {
+		if (filebno < e->e_fileb)
+			break;
+		if (filebno < e->e_fileb + e->e_len) {
+			*diskbno = e->e_start + (filebno - e->e_fileb);
+			return 0;
+		}
+		prev = e;
+	}
+	if (alloc == 0)
+		return -E_NOT_FOUND;
+	next = (e && e->e_len) ? e : 0;
+
+	// grow the previous extent in place
+	if (prev && prev->e_fileb + prev->e_len == filebno && prev->e_len < 0xffff
+	&&  (r = alloc_block_at(prev->e_start + prev->e_len)) >= 0) {
+		prev->e_len++;
+		if (next && next->e_fileb == filebno + 1 && next->e_start == r + 1
+		&&  prev->e_len + next->e_len <= 0xffff) {
+			// the two meet: merge them and close the gap in the table
+			prev->e_len += next->e_len;
+			for (n = i; (from = extent_slot(f, n + 1, 0)) != 0 && from->e_len; n++)
+				*extent_slot(f, n, 0) = *from;
+			to = extent_slot(f, n, 0);
+			to->e_start = to->e_fileb = to->e_len = 0;
+		}
+		*diskbno = r;
+		return 0;
+	}
+
+	if ((r = alloc_block()) < 0)
+		return r;
+	// or grow the next extent backwards
+	if (next && next->e_fileb == filebno + 1 && next->e_start == r + 1
+	&&  next->e_len < 0xffff) {
+		next->e_start--;
+		next->e_fileb--;
+		next->e_len++;
+		*diskbno = r;
+		return 0;
+	}
+
+	// or open a new extent at slot i
+	for (n = i; (e = extent_slot(f, n, 0)) != 0 && e->e_len; n++)
+		;
+	if (extent_slot(f, n, 1) == 0) {
+		free_block(r);
+		return -E_NO_DISK;
+	}
+	for (; n > i; n--)
+		*extent_slot(f, n, 0) = *extent_slot(f, n - 1, 0);
+	e = extent_slot(f, i, 0);
+	e->e_start = r;
+	e->e_fileb = filebno;
+	e->e_len = 1;
+	*diskbno = r;
+	return 0;
+}
+
+/** Free the blocks of a file with #FFLAG_EXTENT from block `nblocks` on.
+ */
+static void
+extent_truncate(struct File *f, u_int nblocks)
+{
+	struct Extent *e;
+	u_int i, keep;
+
+	for (i = 0; (e = extent_slot(f, i, 0)) != 0 && e->e_len; i++) {
+		if (e->e_fileb + e->e_len <= nblocks)
+			continue;
+		keep = nblocks > e->e_fileb ? nblocks - e->e_fileb : 0;
+		while (e->e_len > keep)
+			free_block(e->e_start + --e->e_len);
+		if (e->e_len == 0)
+			e->e_start = e->e_fileb = 0;
+	}
+	// the table only shrinks from the end, so the extent block empties
+	// once the first slot in it does
+	if (f->f_indirect && extent_slot(f, NDEXTENT, 0)->e_len == 0) {
+		free_block(f->f_indirect);
+		f->f_indirect = 0;
+	}
+}
+
+/** Return the slot of the page waiting for a disk block for block
+ * `filebno` of a file, `-1` if there is none.
+ */
+static int
+dalloc_lookup(struct File *f, u_int filebno)
+{
+	int i;
+
+	for (i = 0; i < NDALLOC; i++)
+		if (dalloc[i].d_file == f && dalloc[i].d_fileb == filebno)
+			return i;
+	return -1;
+}
+
+/** Give block `filebno` of a file a zeroed page with no disk block behind
+ * it.
+ *
+ * When no slot is free, one whose page was never written and that no
+ * client maps is taken back; such a page only holds zeros.
+ *
+ * Return the slot, or `-#E_NO_MEM` if every slot is in use.
+ */
+static int
+dalloc_get(struct File *f, u_int filebno)
+{
+	int i, r;
+	u_int va;
+
+	for (i = 0; i < NDALLOC; i++)
+		if (dalloc[i].d_file == 0)
+			break;
+	if (i == NDALLOC) {
+		for (i = 0; i < NDALLOC; i++) {
+			va = DALLOCVA + i * BY2PG;
+			if (!va_is_dirty(va) && pageref((void*)va) == 1) {
+				syscall_mem_unmap(0, va);
+				break;
+			}
+		}
+		if (i == NDALLOC)
+			return -E_NO_MEM;
+	}
+	if ((r = syscall_mem_alloc(0, DALLOCVA + i * BY2PG, PTE_V|PTE_DTRACK|PTE_LIBRARY)) < 0)
+		return r;
+	dalloc[i].d_file = f;
+	dalloc[i].d_fileb = filebno;
+	return i;
+}
+
+/** Drop the pages waiting for a disk block of a file from block `nblocks`
+ * on. They never need one.
+ */
+static void
+dalloc_drop(struct File *f, u_int nblocks)
+{
+	int i;
+
+	for (i = 0; i < NDALLOC; i++)
+		if (dalloc[i].d_file == f && dalloc[i].d_fileb >= nblocks) {
+			syscall_mem_unmap(0, DALLOCVA + i * BY2PG);
+			dalloc[i].d_file = 0;
+		}
+}
+
+int file_map_block(struct File *f, u_int filebno, u_int *diskbno, u_int alloc);
+
+/** Choose disk blocks for the written pages of a file waiting for one.
+ *
+ * Blocks are allocated in file order, so the extent allocator lays them
+ * out one after another. Each page then moves, as it is, to its block in
+ * the cache, dirty, and leaves the slot. Pages nobody wrote keep waiting.
+ *
+ * If a block cannot be had, return the error; the pages from that one on
+ * keep waiting in their slots.
+ */
+static int
+dalloc_flush(struct File *f)
+{
+	u_short idx[NDALLOC];
+	u_int diskbno, va;
+	int i, j, n, r, t;
+
+	n = 0;
+	for (i = 0; i < NDALLOC; i++)
+		if (dalloc[i].d_file == f && va_is_dirty(DALLOCVA + i * BY2PG)) {
+			for (j = n++; j > 0 && dalloc[idx[j-1]].d_fileb > dalloc[i].d_fileb; j--)
+				idx[j] = idx[j-1];
+			idx[j] = i;
+		}
+
+	for (j = 0; j < n; j++) {
+		t = idx[j];
+		va = DALLOCVA + t * BY2PG;
+		if ((r = file_map_block(f, dalloc[t].d_fileb, &diskbno, 1)) < 0)
+			return r;
+		if ((r = syscall_mem_map(0, va, 0, diskaddr(diskbno),
+				PTE_V|PTE_R|PTE_D|PTE_DTRACK|PTE_LIBRARY)) < 0)
+			return r;
+		syscall_mem_unmap(0, va);
+		dalloc[t].d_file = 0;
+	}
+	return 0;
+}
+
 // Set *diskbno to the disk block number for the filebno'th block in file f.
 // If alloc is set and the block does not exist, allocate it.
 /** Map a physic block to a block of a file.
@@ -499,18 +1078,42 @@ file_map_block(struct File *f, u_int filebno, u_int *diskbno, u_int alloc)
 {
 	int r;
 	u_int *ptr;
-
-	if ((r = file_block_walk(f, filebno, &ptr, alloc)) < 0)
-		return r;
-	if (*ptr == 0) {
-		if (alloc == 0)
-			return -E_NOT_FOUND;
-		if ((r = alloc_block()) < 0)
-			return r;
-		*ptr = r;
+	void *ind;
+
+	// Allocating may evict blocks; keep the one ptr (or the extents)
+	// point into in memory meanwhile.
+	ind = 0;
+	if (alloc && f->f_indirect && read_block(f->f_indirect, &ind, 0) == 0)
+		block_pin(ind);
+
+	if (f->f_flags & FFLAG_EXTENT)
+		r = extent_map_block(f, filebno, diskbno, alloc);
+	else if ((r = file_block_walk(f, filebno, &ptr, alloc)) == 0) {
+		if (alloc && ind == 0 && f->f_indirect
+		&&  read_block(f->f_indirect, &ind, 0) == 0)
+			block_pin(ind);
+		// past NINDIRECT, ptr is in a block beneath f_dindirect
+		if (alloc && filebno >= NINDIRECT) {
+			if (ind)
+				block_unpin(ind);
+			ind = ptr;
+			block_pin(ind);
+		}
+		if (*ptr == 0) {
+			if (alloc == 0)
+				r = -E_NOT_FOUND;
+			else if ((r = alloc_block()) >= 0) {
+				*ptr = r;
+				r = 0;
+			}
+		}
+		if (r == 0)
+			*diskbno = *ptr;
 	}
-	*diskbno = *ptr;
-	return 0;
+
+	if (ind)
+		block_unpin(ind);
+	return r;
 }
 
 // Remove a block from file f.  If it's not there, just silently succeed.
@@ -527,8 +1130,8 @@ file_clear_block(struct File *f, u_int filebno)
 	int r;
 	u_int *ptr = NULL;
 
-	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0 && r != -E_NOT_FOUND)
-		return r;
+	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
+		return r == -E_NOT_FOUND ? 0 : r;
 //writef("come here\n");
 	if (*ptr) {
 		free_block(*ptr);
@@ -543,8 +1146,10 @@ file_clear_block(struct File *f, u_int filebno)
 /** Make sure a block of a file is loaded into memory, set *blk to the address
  * of the block in memory.
  *
- * If the specific block doesn't exist, allocate a physic block to it and then
- * load it. 
+ * If the specific block doesn't exist, only give it a page for now; a disk
+ * block is chosen when the page is written back, see file_flush(). Blocks
+ * of directories, and blocks met when too many pages wait already, get a
+ * disk block right away.
  *
  * \warning No guarantee is provided the content of the allocated block. The
  * contents of it can be
@@ -557,12 +1162,25 @@ file_clear_block(struct File *f, u_int filebno)
 int
 file_get_block(struct File *f, u_int filebno, void **blk)
 {
-	int r, isnew;
+	int r, i, isnew;
 	u_int diskbno;
 
 	// Your code here -- read in the block, leaving the pointer in *blk.
 //	user_panic("file_get_block not implemented");
-	r = file_map_block(f, filebno, &diskbno, 1/*0*/);
+	r = file_map_block(f, filebno, &diskbno, 0);
+	// File structures are used by pointer, so directory blocks must not
+	// move: they get their disk block at once
+	if(r == -E_NOT_FOUND && f->f_type != FTYPE_DIR)
+	{
+		if((i = dalloc_lookup(f, filebno)) < 0)
+			i = dalloc_get(f, filebno);
+		if(i >= 0)
+		{
+			*blk = (void*)(DALLOCVA + i * BY2PG);
+			return 0;
+		}
+		r = file_map_block(f, filebno, &diskbno, 1);
+	}
 	//writef("file_get_block:diskno:0x%x\n", diskbno);
 	if(r<0) return r;
 	
@@ -587,9 +1205,6 @@ for(i = 0;i<1024;i++)
 /** Mark the block where offset is in dirty by writing its first word to
  * itself.
  *
- * \warning Due to that there is no mechanism to distinguish whether a page is
- * clean, the function is not implemented actually.
- *
  * @param[in] f Pointer to the file.
  * @param[in] offset Offset of the file, indicate which block is to be dirty.
  */
@@ -605,6 +1220,153 @@ file_dirty(struct File *f, u_int offset)
 	return 0;
 }
 
+/** Hash a file name to one of the #NDBUCKET chains of a directory index.
+ *
+ * @param[in] name Name of the file.
+ */
+static u_int
+dir_hash(const u_char *name)
+{
+	u_int h = 5381;
+
+	while (*name)
+		h = h * 33 + *name++;
+	return h % NDBUCKET;
+}
+
+/** Set *file to the entry of dir at `pos`, its index in dir plus one.
+ *
+ * @param[in] dir Pointer to the directory.
+ * @param[in] pos Index of the entry plus one, as kept in the hash chains.
+ * @param[out] file Address of the pointer to the entry.
+ */
+static int
+dir_entry(struct File *dir, u_int pos, struct File **file)
+{
+	int r;
+	void *blk;
+
+	if ((r = file_get_block(dir, (pos - 1) / FILE2BLK, &blk)) < 0)
+		return r;
+	*file = (struct File *)blk + (pos - 1) % FILE2BLK;
+	return 0;
+}
+
+/** Build the hash index of dir from its entries.
+ *
+ * The index is one block of #NDBUCKET chain heads. Each chain links the
+ * entries whose names hash to it through their f_hnext fields, so a lookup
+ * only compares the names on one chain instead of every entry of dir.
+ *
+ * If an error occurs, dir is left without an index and lookups scan it.
+ * The failure is recorded in dindex_failed, and no other directory gets an
+ * index built afterwards, since that would most likely fail as well.
+ *
+ * @param[in] dir Pointer to the directory.
+ */
+static int
+dir_index_build(struct File *dir)
+{
+	int r;
+	u_int i, j, h, nblock, *bucket;
+	void *blk;
+	struct File *f;
+
+	if ((r = alloc_block()) < 0) {
+		dindex_failed = 1;
+		return r;
+	}
+	bucket = (u_int *)diskaddr(r);
+	user_bzero(bucket, BY2BLK);
+	block_pin(bucket);
+
+	nblock = (dir->f_size + BY2BLK - 1) / BY2BLK;
+	for (i = 0; i < nblock; i++) {
+		if ((r = file_get_block(dir, i, &blk)) < 0) {
+			block_unpin(bucket);
+			free_block(((u_int)bucket - DISKMAP) / BY2BLK);
+			dindex_failed = 1;
+			return r;
+		}
+		f = blk;
+		for (j = 0; j < FILE2BLK; j++) {
+			if (f[j].f_name[0] == '\0')
+				continue;
+			h = dir_hash(f[j].f_name);
+			f[j].f_hnext = bucket[h];
+			bucket[h] = i * FILE2BLK + j + 1;
+		}
+	}
+	dir->f_dindex = ((u_int)bucket - DISKMAP) / BY2BLK;
+	block_unpin(bucket);
+	return 0;
+}
+
+/** Put the entry f of dir, at `pos`, on the hash chain of its name.
+ *
+ * Do nothing if dir has no index.
+ *
+ * @param[in] dir Pointer to the directory.
+ * @param[in] f Pointer to the entry, which already has its name.
+ * @param[in] pos Index of the entry in dir plus one.
+ */
+static int
+dir_index_add(struct File *dir, struct File *f, u_int pos)
+{
+	int r;
+	u_int h, *bucket;
+
+	if (dir->f_dindex == 0)
+		return 0;
+	block_pin(f);
+	if ((r = read_block(dir->f_dindex, (void **)&bucket, 0)) == 0) {
+		h = dir_hash(f->f_name);
+		f->f_hnext = bucket[h];
+		bucket[h] = pos;
+	}
+	block_unpin(f);
+	return r;
+}
+
+/** Take the entry f of dir off the hash chain of its name.
+ *
+ * Do nothing if dir has no index.
+ *
+ * @param[in] dir Pointer to the directory.
+ * @param[in] f Pointer to the entry, which still has its name.
+ */
+static void
+dir_index_del(struct File *dir, struct File *f)
+{
+	u_int h, pos, prev, *bucket;
+	struct File *e;
+
+	if (dir->f_dindex == 0)
+		return;
+	if (read_block(dir->f_dindex, (void **)&bucket, 0) < 0)
+		return;
+	block_pin(bucket);
+	block_pin(f);
+
+	h = dir_hash(f->f_name);
+	prev = 0;
+	for (pos = bucket[h]; pos != 0; prev = pos, pos = e->f_hnext) {
+		if (dir_entry(dir, pos, &e) < 0)
+			break;
+		if (e != f)
+			continue;
+		if (prev == 0)
+			bucket[h] = f->f_hnext;
+		else if (dir_entry(dir, prev, &e) == 0)
+			e->f_hnext = f->f_hnext;
+		break;
+	}
+	f->f_hnext = 0;
+
+	block_unpin(f);
+	block_unpin(bucket);
+}
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
 /** Try to find a file named `name` in dir.
  *
@@ -621,16 +1383,39 @@ int
 dir_lookup(struct File *dir, char *name, struct File **file)
 {
 	int r;
-	u_int i, j, nblock;
+	u_int i, j, nblock, pos;
 	void *blk;
 	struct File *f;
 
-	// search dir for name
+	// reading the entries must not evict dir itself
+	block_pin(dir);
 	nblock = (dir->f_size + BY2BLK - 1) / BY2BLK;
+
+	// a large directory only has the names on one hash chain compared
+	if (dir->f_dindex) {
+		if ((r = read_block(dir->f_dindex, &blk, 0)) < 0)
+			goto out;
+		for (pos = ((u_int *)blk)[dir_hash((u_char *)name)]; pos != 0; pos = f->f_hnext) {
+			if ((r = dir_entry(dir, pos, &f)) < 0)
+				goto out;
+			if (strcmp(f->f_name, name) == 0) {
+				*file = f;
+				f->f_dir = dir;
+				r = 0;
+				goto out;
+			}
+		}
+		r = -E_NOT_FOUND;
+		goto out;
+	}
+
+	// search dir for name
+	r = -E_NOT_FOUND;
 	for (i = 0; i < nblock; i++)
    	{
 		if ((r=file_get_block(dir, i, &blk)) < 0)
-			return r;
+			goto out;
+		r = -E_NOT_FOUND;
 		f = blk;
 		for (j=0; j<FILE2BLK; j++)
 		{
@@ -639,23 +1424,30 @@ dir_lookup(struct File *dir, char *name, struct File **file)
 			{
 				*file = &f[j];
 				f[j].f_dir = dir;
-				return 0;
+				r = 0;
+				goto out;
 			}
 		}
 	}
-	return -E_NOT_FOUND;	
+out:
+	block_unpin(dir);
+	return r;
 }
 
 // Set *file to point at a free File structure in dir.
-/** Find a free File structure in dir and set *file pointing to it.
+/** Find a free File structure in dir, name it and set *file pointing to it.
+ *
+ * The new entry is put on the hash index of dir, and a directory growing to
+ * #DINDEX_MIN blocks gets its index built.
  *
  * On success, return `0`, otherwise, return an error code.
  *
  * @param[in] dir Pointer to the directory.
+ * @param[in] name Name of the new file.
  * @param[in] file Address of the pointor to the allocated file.
  */
 int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, char *name, struct File **file)
 {
 	int r;
 	u_int nblock, i , j;
@@ -671,18 +1463,28 @@ dir_alloc_file(struct File *dir, struct File **file)
 		for (j = 0; j < FILE2BLK; j++)
 		{
 			if (f[j].f_name[0] == '\0')
-			{
-				*file = &f[j];
-				return 0;
-			}
+				goto found;
 		}
 	}
 	dir->f_size += BY2BLK;
 	if ((r = file_get_block(dir, i, &blk)) < 0)
 		return r;
 	f = blk;
-	*file = &f[0];
-	return 0;		
+	j = 0;
+	nblock++;
+
+found:
+	// a slot freed by file_remove() keeps the layout of its last file
+	f[j].f_flags = 0;
+	f[j].f_dindex = 0;
+	f[j].f_dindirect = 0;
+	strcpy(f[j].f_name, name);
+	*file = &f[j];
+	if (dir->f_dindex)
+		return dir_index_add(dir, &f[j], i * FILE2BLK + j + 1);
+	if (nblock >= DINDEX_MIN && !dindex_failed)
+		dir_index_build(dir);
+	return 0;
 }
 
 // Skip over slashes.
@@ -700,6 +1502,87 @@ skip_slash(char *p)
 	return p;
 }
 
+/** An entry of the path lookup cache.
+ *
+ * Maps the name of a path component in a directory to its File, or to `0`
+ * when the directory has no such file. Entries are direct-mapped by a hash of
+ * both, see dcache_slot().
+ */
+struct Dcache {
+	struct File *d_dir;
+	struct File *d_file;
+	char d_name[MAXNAMELEN];
+};
+
+static struct Dcache dcache[NDCACHE];
+
+/** Return the cache entry for the `len` bytes long name at `name` in dir.
+ *
+ * @param[in] dir Pointer to the directory.
+ * @param[in] name The name, which need not be null terminated.
+ * @param[in] len Length of the name.
+ */
+static struct Dcache *
+dcache_slot(struct File *dir, const char *name, u_int len)
+{
+	u_int h = (u_int)dir / BY2FILE;
+
+	while (len-- > 0)
+		h = h * 33 + (u_char)*name++;
+	return &dcache[h % NDCACHE];
+}
+
+/** Check whether the entry d holds the `len` bytes long name at `name` in
+ * dir.
+ */
+static int
+dcache_match(struct Dcache *d, struct File *dir, const char *name, u_int len)
+{
+	u_int i;
+
+	if (d->d_dir != dir)
+		return 0;
+	for (i = 0; i < len; i++)
+		if (d->d_name[i] != name[i])
+			return 0;
+	return d->d_name[len] == '\0';
+}
+
+/** Record that `name` in dir is file, or is missing if file is `0`.
+ *
+ * @param[in] dir Pointer to the directory.
+ * @param[in] name Null terminated name.
+ * @param[in] file Pointer to the file or `0`.
+ */
+static void
+dcache_enter(struct File *dir, const char *name, struct File *file)
+{
+	struct Dcache *d;
+
+	d = dcache_slot(dir, name, strlen(name));
+	d->d_dir = dir;
+	d->d_file = file;
+	strcpy(d->d_name, name);
+}
+
+/** Drop the cache entries of f and of the files in it.
+ *
+ * Removing a directory drops the whole cache, since the entries of its
+ * subdirectories would point into freed blocks.
+ *
+ * @param[in] f Pointer to the file removed.
+ */
+static void
+dcache_purge(struct File *f)
+{
+	int i;
+
+	for (i = 0; i < NDCACHE; i++)
+		if (f->f_type == FTYPE_DIR || dcache[i].d_dir == f
+				|| dcache[i].d_file == f)
+			dcache[i].d_dir = 0;
+}
+
 // Evaluate a path name, starting at the root.
 // On success, set *pfile to the file we found
 // and set *pdir to the directory the file is in.
@@ -717,6 +1600,10 @@ skip_slash(char *p)
  *
  * *pdir and *pfile will be clear at first.
  *
+ * The blocks of the *pdir and *pfile set are pinned, so that the pointers
+ * stay good while the caller reads other blocks; it drops them with
+ * block_unpin(). So is each directory while it is searched.
+ *
  * If some errors occur, return an error code.
  *
  * @param[in] path Path string.
@@ -731,12 +1618,15 @@ walk_path(char *path, struct File **pdir, struct File **pfile, char *lastelem)
 	char *p;
 	char name[MAXNAMELEN];
 	struct File *dir, *file;
+	struct Dcache *d;
+	u_int len;
 	int r;
 
 	// if (*path != '/')
 	//	return -E_BAD_PATH;
 	path = skip_slash(path);
 	file = &super->s_root;
+	block_pin(file);
 	dir = 0;
 	name[0] = 0;
 
@@ -745,34 +1635,63 @@ walk_path(char *path, struct File **pdir, struct File **pfile, char *lastelem)
 	*pfile = 0;
 	
 	while (*path != '\0') {
+		if (dir)
+			block_unpin(dir);
 		dir = file;
 	//	writef("walk_path(): dir:%s\n",dir->f_name);
 		p = path;
 		while (*path != '/' && *path != '\0')
 			path++;
-		if (path - p >= MAXNAMELEN)
+		if (path - p >= MAXNAMELEN) {
+			block_unpin(dir);
 			return -E_BAD_PATH;//user_panic("!!!!!!!!!!!!!!!!!! src:%x dst:%x len:%x",p, name, path - p);
-		user_bcopy(p, name, path - p);
-		name[path - p] = '\0';
+		}
+		len = path - p;
 		path = skip_slash(path);
 
-		if (dir->f_type != FTYPE_DIR)
+		if (dir->f_type != FTYPE_DIR) {
+			block_unpin(dir);
 			return -E_NOT_FOUND;
+		}
 
-		if ((r=dir_lookup(dir, name, &file)) < 0) {
+		// a cached component skips the directory scan, misses included
+		d = dcache_slot(dir, p, len);
+		if (dcache_match(d, dir, p, len)) {
+			r = -E_NOT_FOUND;
+			if ((file = d->d_file) != 0
+					&& (r = read_block(((u_int)file - DISKMAP) / BY2BLK, 0, 0)) == 0
+					&& file->f_dir != dir)
+				file->f_dir = dir;
+		} else {
+			user_bcopy(p, name, len);
+			name[len] = '\0';
+			r = dir_lookup(dir, name, &file);
+			if (r == 0 || r == -E_NOT_FOUND)
+				dcache_enter(dir, name, r == 0 ? file : 0);
+		}
+
+		if (r < 0) {
 			if(r == -E_NOT_FOUND && *path == '\0') {
 				if(pdir)
 					*pdir = dir;
-				if (lastelem)
-					strcpy(lastelem, name);
+				if (lastelem) {
+					user_bcopy(p, lastelem, len);
+					lastelem[len] = '\0';
+				}
 				*pfile = 0;
 			}
+			if(!pdir || *pdir != dir)
+				block_unpin(dir);
 			return r;
 		}
+		// the lookup has just read its block in
+		block_pin(file);
 	}
 
 	if(pdir)
 		*pdir = dir;
+	else if(dir)
+		block_unpin(dir);
 	*pfile = file;
 	return 0;
 }
@@ -783,7 +1702,7 @@ walk_path(char *path, struct File **pdir, struct File **pfile, char *lastelem)
  *
  * On sucess, return `0`, otherwise, return an error code.
  *
- * Just a simple wrap of walk_path().
+ * Just a simple wrap of walk_path(). The block of *file is left pinned.
  *
  * @param[in] path Path string.
  * @param[out] file Address of the pointor to the result file.
@@ -808,8 +1727,12 @@ file_open(char *path, struct File **file)
 		(*file)->f_type = FTYPE_REG;
 		*/
 //		writef("%s:%e\n",path,r);
+		if (pdir)
+			block_unpin(pdir);
 		return r;
 	}
+	if (pdir)
+		block_unpin(pdir);
 	*file = f;
 	return 0;
 }
@@ -822,6 +1745,8 @@ file_open(char *path, struct File **file)
  * file has existed, the directory where the file is in doesn't exist, or any
  * other errors occur, return an error code.
  *
+ * The block of *file is left pinned, as by file_open().
+ *
  * @param[in] path Path string.
  * @param[out] file Address of the pointor to the result file.
  */
@@ -832,17 +1757,55 @@ file_create(char *path, struct File **file)
 	int r;
 	struct File *dir, *f;
 
-	if ((r = walk_path(path, &dir, &f, name)) == 0)
+	if ((r = walk_path(path, &dir, &f, name)) == 0) {
+		block_unpin(f);
+		if (dir)
+			block_unpin(dir);
 		return -E_FILE_EXISTS;
+	}
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if (dir_alloc_file(dir, &f) < 0)
+	if (dir_alloc_file(dir, name, &f) < 0) {
+		block_unpin(dir);
 		return r;
-	strcpy(f->f_name, name);
+	}
+	block_pin(f);
+	block_unpin(dir);
+	dcache_enter(dir, name, f);
 	*file = f;
 	return 0;
 }
 
+/** Free the indirect blocks beneath f_dindirect that no longer hold any of
+ * the first nblocks blocks of the file, and f_dindirect itself when none do.
+ *
+ * The data blocks must have been cleared already.
+ *
+ * @param[in] f Pointer to the file.
+ * @param[in] nblocks Number of blocks the file keeps.
+ */
+static void
+file_truncate_dindirect(struct File *f, u_int nblocks)
+{
+	u_int i, first, *dind;
+
+	if (f->f_dindirect == 0 || read_block(f->f_dindirect, (void **)&dind, 0) < 0)
+		return;
+	first = 0;
+	if (nblocks > NINDIRECT)
+		first = (nblocks - NINDIRECT + NINDIRECT - 1) / NINDIRECT;
+	for (i = first; i < NINDIRECT; i++) {
+		if (dind[i]) {
+			free_block(dind[i]);
+			dind[i] = 0;
+		}
+	}
+	if (first == 0) {
+		free_block(f->f_dindirect);
+		f->f_dindirect = 0;
+	}
+}
+
 // Truncate file down to newsize bytes.  
 // Since the file is shorter, we can free the blocks
 // that were used by the old bigger version but not
@@ -868,23 +1831,72 @@ file_truncate(struct File *f, u_int newsize)
 	u_int bno, old_nblocks, new_nblocks;
 
 	// Your code here
+	// freeing reads indirect blocks, which must not evict f's own
+	block_pin(f);
 	old_nblocks = (f->f_size + BY2BLK - 1) / BY2BLK;
 	new_nblocks = (newsize + BY2BLK - 1) / BY2BLK;
 	if(newsize == 0) new_nblocks = 0;
+	dalloc_drop(f, new_nblocks);
+	if(f->f_flags & FFLAG_EXTENT)
+	{
+		extent_truncate(f, new_nblocks);
+		f->f_size = newsize;
+		block_unpin(f);
+		return;
+	}
 //writef("file_truncate:begin,	new_nblocks=%d\n",new_nblocks);	
 //writef("file_truncate:come in <=NDIRECT\n");
 	for(bno = new_nblocks; bno < old_nblocks; bno++)
 		file_clear_block(f, bno);
-	if(f->f_indirect)
+	file_truncate_dindirect(f, new_nblocks);
+	if(new_nblocks <= NDIRECT && f->f_indirect)
 	{
 		free_block(f->f_indirect);
 		f->f_indirect = 0;
 	}
+	// an empty regular file is laid out anew, in extents
+	if(new_nblocks == 0 && f->f_type == FTYPE_REG)
+		f->f_flags |= FFLAG_EXTENT;
 	f->f_size = newsize;
+	block_unpin(f);
 	return;
 //	user_panic("file_truncate not implemented");
 }
 
+/** Write back the blocks of File structures left dirty by file_set_size().
+ *
+ * Called when a file is closed, on sync, when the list fills up and every
+ * so often by the server loop.
+ */
+void
+meta_flush(void)
+{
+	u_int i;
+
+	for (i = 0; i < meta_n; i++)
+		if (block_is_dirty(meta_block[i]))
+			write_block_async(meta_block[i]);
+	meta_n = 0;
+}
+
+/** Note that the File structure f changed in memory only.
+ *
+ * @param[in] f Pointer to the File structure.
+ */
+static void
+meta_defer(struct File *f)
+{
+	u_int i, blockno;
+
+	blockno = ((u_int)f - DISKMAP) / BY2BLK;
+	for (i = 0; i < meta_n; i++)
+		if (meta_block[i] == blockno)
+			return;
+	if (meta_n == NMETA)
+		meta_flush();
+	meta_block[meta_n++] = blockno;
+}
+
 /** Set file's size to newsize bytes.
  * 
  * If newsize is less than the old size, truncate file down via
@@ -900,11 +1912,13 @@ int
 file_set_size(struct File *f, u_int newsize)
 {
 //writef("f->f_name=%s,	f->f_size=%d\n",f->f_name,f->f_size);
+	if (newsize > MAXFILESIZE)
+		return -E_NO_DISK;
 	if (f->f_size > newsize)
 		file_truncate(f, newsize);
 	f->f_size = newsize;
-	if (f->f_dir)
-		file_flush(f->f_dir);
+	// the new size reaches the disk at close or sync, not on every change
+	meta_defer(f);
 	return 0;
 }
 
@@ -916,60 +1930,128 @@ file_set_size(struct File *f, u_int newsize)
 // Hint: use file_map_block, block_is_dirty, and write_block.
 /** Flush dirty blocks of the file out to disk.
  *
- * If any error occurs, return an error code.
+ * Written pages still waiting for a disk block get one first, see
+ * dalloc_flush(). Holes are skipped.
+ *
+ * If any error occurs, return an error code. The blocks that have one are
+ * written out all the same.
  *
  * @param[in] f Pointor to the file to be flushed.
  */
-void
+int
 file_flush(struct File *f)
 {
 	// Your code here
 	u_int nblocks;
 	u_int bno;
 	u_int diskno;
-	int r;
+	int r, err;
 
+	err = dalloc_flush(f);
 	nblocks = (f->f_size + BY2BLK - 1) / BY2BLK;
 	for(bno = 0;bno < nblocks;bno++)
 	{
 		r = file_map_block(f, bno, &diskno, 0);
-		if(r<0) return r;
+		if(r<0) continue;	//a hole
 		if(block_is_dirty(diskno))
-			write_block(diskno);
+			write_block_async(diskno);
 	}
-	return 0;
+	if (f->f_dindex && block_is_dirty(f->f_dindex))
+		write_block_async(f->f_dindex);
+	return err;
 //	user_panic("file_flush not implemented");
 }
 
+/** Read blocks [filebno, end) of the file into the cache ahead of use.
+ *
+ * Blocks already in memory, holes and blocks past the end of the file are
+ * skipped. Read-ahead blocks start with their reference bit clear, so those
+ * never used are the first to be evicted.
+ *
+ * @param[in] f Pointer to the file.
+ * @param[in] filebno First block of the file to read.
+ * @param[in] end Block of the file to stop at.
+ */
+void
+file_readahead(struct File *f, u_int filebno, u_int end)
+{
+	u_int diskbno;
+	struct Bcache *b;
+	int r;
+
+	end = MIN(end, (f->f_size + BY2BLK - 1) / BY2BLK);
+	for (; filebno < end; filebno++) {
+		if (file_map_block(f, filebno, &diskbno, 0) < 0 || diskbno == 0
+		||  block_is_mapped(diskbno))
+			continue;
+		if ((b = bcache_load(diskbno, &r)) == 0)
+			return;
+		b->bc_ref = 0;
+		b->bc_ra = 1;
+		bcstat.bs_ra++;
+	}
+}
+
 // Sync the entire file system.  A big hammer.
 /** Synchronize the entire file system.
  *
- * Flush all dirty blocks out to disk.
+ * Give every written page waiting for a disk block one, then flush all
+ * dirty blocks out to disk in ascending block order.
+ *
+ * Only blocks in the cache can be dirty, so only the #NBCACHE cache slots
+ * are checked, however large the disk is.
+ *
+ * Return the first error of giving pages their disk blocks, or `0`.
  */
-void
+int
 fs_sync(void)
 {
-	int i;
-
-	for (i=0; i<super->s_nblocks; i++)
-		if (block_is_dirty(i))
-			write_block(i);
+	static u_int dirty[NBCACHE];
+	u_int blockno;
+	int i, j, n, r, err;
+
+	meta_n = 0;
+	err = 0;
+	for (i=0; i<NDALLOC; i++)
+		if (dalloc[i].d_file && va_is_dirty(DALLOCVA + i * BY2PG)
+		&&  (r = dalloc_flush(dalloc[i].d_file)) < 0 && err == 0)
+			err = r;
+
+	n = 0;
+	for (i=0; i<bc_nused; i++) {
+		if (!bcache[i].bc_inuse || !block_is_dirty(bcache[i].bc_blockno))
+			continue;
+		blockno = bcache[i].bc_blockno;
+		for (j = n++; j > 0 && dirty[j-1] > blockno; j--)
+			dirty[j] = dirty[j-1];
+		dirty[j] = blockno;
+	}
+	for (j=0; j<n; j++)
+		write_block_async(dirty[j]);
+	return err;
 }
 
 // Close a file.
 /** Close a file.
  *
  * Flush the content of the file to disk. If it has a parent directory, do the
- * same thing to the directory.
+ * same thing to the directory. Then flush the bitmap, which allocations
+ * only change in memory.
+ *
+ * Return the first error of file_flush(), or `0`.
  *
  * @param[in] f Pointor to the file to be flushed.
  */
-void
+int
 file_close(struct File *f)
 {
-	file_flush(f);
-	if (f->f_dir)
-		file_flush(f->f_dir);
+	int r, r2;
+
+	r = file_flush(f);
+	if (f->f_dir && (r2 = file_flush(f->f_dir)) < 0 && r == 0)
+		r = r2;
+	bitmap_flush();
+	return r;
 }
 
 // Remove a file by truncating it and then zeroing the name.
@@ -985,17 +2067,34 @@ int
 file_remove(char *path)
 {
 	int r;
-	struct File *f;
+	struct File *dir, *f;
 
-	if ((r = walk_path(path, 0, &f, 0)) < 0)
+	// f and its directory stay pinned while blocks are freed and read
+	if ((r = walk_path(path, &dir, &f, 0)) < 0) {
+		if (dir)
+			block_unpin(dir);
 		return r;
+	}
 
 	file_truncate(f, 0);
+	if (f->f_dindex) {
+		free_block(f->f_dindex);
+		f->f_dindex = 0;
+	}
+	dcache_purge(f);
+	if (f->f_dir) {
+		dir_index_del(f->f_dir, f);
+		dcache_enter(f->f_dir, (char *)f->f_name, 0);
+	}
 	f->f_name[0] = '\0';
 	file_flush(f);
 	if (f->f_dir)
 		file_flush(f->f_dir);
+	bitmap_flush();
 
+	block_unpin(f);
+	if (dir)
+		block_unpin(dir);
 	return 0;
 }
 
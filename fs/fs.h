@@ -22,23 +22,81 @@
 /// Maximum disk size we can handle (3GB)
 #define DISKMAX		0xc0000000
 
+/** Number of disk blocks kept mapped at DISKMAP at once.
+ *
+ * When the cache is full, a block not used for a while is written back
+ * if dirty and unmapped (see read_block()).
+ */
+#define NBCACHE		1024
+
+/** Base address of the pages of file blocks that have no disk block yet.
+ *
+ * A block written through a hole of a file only gets a disk block when it
+ * is written back (see file_get_block()). Until then its page sits at
+ * `DALLOCVA + (n * BY2PG)` for some slot n.
+ */
+#define DALLOCVA	0x0e000000
+
+/// Number of file blocks that may wait for a disk block at once
+#define NDALLOC		256
+
+/// Directories of at least this many blocks get a hash index of their names
+#define DINDEX_MIN	4
+
+/// Number of hash chains of a directory index, which fill one block
+#define NDBUCKET	(BY2BLK/4)
+
+/// Number of entries of the path lookup cache
+#define NDCACHE		256
+
+/** Number of blocks of File structures whose size changes may wait in
+ * memory at once, see meta_flush().
+ */
+#define NMETA		16
+
+/** Counters of the block cache.
+ */
+struct Bcstat {
+	u_int bs_hits;		//!< read_block() found the block mapped
+	u_int bs_misses;	//!< read_block() had to read it from disk
+	u_int bs_evicts;	//!< blocks unmapped to make room
+	u_int bs_writebacks;	//!< evicted blocks that were dirty
+	u_int bs_ra;		//!< blocks read ahead by file_readahead()
+	u_int bs_rahits;	//!< read-ahead blocks used afterwards
+	u_int bs_rawaste;	//!< read-ahead blocks evicted unused
+};
+
 /* ide.c */
 void ide_read(u_int diskno, u_int secno, void *dst, u_int nsecs);
 void ide_write(u_int diskno, u_int secno, void *src, u_int nsecs);
+void ide_write_async(u_int diskno, u_int secno, void *src, u_int nsecs);
+int ide_pending(void);
+void ide_poll(void);
+void ide_flush(void);
 
 /* fs.c */
 int file_open(char *path, struct File **pfile);
 int file_get_block(struct File *f, u_int blockno, void **pblk);
 int file_set_size(struct File *f, u_int newsize);
-void file_close(struct File *f);
+int file_close(struct File *f);
 int file_remove(char *path);
 void fs_init(void);
 int file_dirty(struct File *f, u_int offset);
-void fs_sync(void);
-void file_flush(struct File*);
+int fs_sync(void);
+int file_flush(struct File*);
+void file_readahead(struct File *f, u_int filebno, u_int end);
 extern u_int *bitmap;
+extern u_int nfree;
+extern struct Bcstat bcstat;
 int map_block(u_int);
 int alloc_block(void);
+void bitmap_flush(void);
+void meta_flush(void);
+void block_pin(void *va);
+void block_unpin(void *va);
+
+/* ../user/string.c */
+int strlen(const char *s);
 
 /* test.c */
 void fs_test(void);
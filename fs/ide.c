@@ -51,3 +51,119 @@ ide_write(u_int diskno, u_int secno, void *src, u_int nsecs)
 	}
 }
 
+
+/* Write-behind queue.
+ *
+ * The disk of GXemul completes a sector as soon as it is started and
+ * raises no interrupt, so "asynchronous" writes are queued here and
+ * carried out by ide_poll() while the server has nothing else to do.
+ * The queue is kept sorted by sector and adjacent writes are merged, so
+ * it drains in one sweep across the disk (C-SCAN).
+ */
+#define NDISKREQ	32
+
+struct Diskreq {
+	u_int dr_secno;		// first sector
+	u_int dr_nsecs;		// number of sectors
+	void *dr_buf;		// memory of the first sector
+};
+
+static struct Diskreq diskq[NDISKREQ];
+static u_int ndiskq;		// requests in diskq
+static u_int diskhead;		// sector after the last one written
+
+/* Carry out request i and take it off the queue. Its blocks, pinned by
+ * ide_write_async(), may leave the cache again. */
+static void
+ide_done(u_int i)
+{
+	struct Diskreq *dr;
+	u_int n;
+
+	dr = &diskq[i];
+	ide_write(DISKNO, dr->dr_secno, dr->dr_buf, dr->dr_nsecs);
+	for (n = 0; n < dr->dr_nsecs; n += SECT2BLK)
+		block_unpin(dr->dr_buf + n * BY2SECT);
+	diskhead = dr->dr_secno + dr->dr_nsecs;
+	for (ndiskq--; i < ndiskq; i++)
+		diskq[i] = diskq[i+1];
+}
+
+// Queue a write of nsecs sectors from src, which must be whole cached
+// blocks; they are pinned until written. Returns at once unless the
+// queue is full.
+void
+ide_write_async(u_int diskno, u_int secno, void *src, u_int nsecs)
+{
+	struct Diskreq *dr;
+	u_int i, n;
+
+	// already queued: the write will pick up the current contents
+	for (i = 0; i < ndiskq; i++)
+		if (diskq[i].dr_secno <= secno
+		&&  secno + nsecs <= diskq[i].dr_secno + diskq[i].dr_nsecs)
+			return;
+	if (ndiskq == NDISKREQ)
+		ide_poll();
+
+	for (n = 0; n < nsecs; n += SECT2BLK)
+		block_pin(src + n * BY2SECT);
+	for (i = 0; i < ndiskq && diskq[i].dr_secno < secno; i++)
+		;
+
+	// merge with the request before, the one after, or both
+	if (i > 0 && diskq[i-1].dr_secno + diskq[i-1].dr_nsecs == secno
+	&&  diskq[i-1].dr_buf + diskq[i-1].dr_nsecs * BY2SECT == src) {
+		dr = &diskq[i-1];
+		dr->dr_nsecs += nsecs;
+		if (i < ndiskq && dr->dr_secno + dr->dr_nsecs == diskq[i].dr_secno
+		&&  dr->dr_buf + dr->dr_nsecs * BY2SECT == diskq[i].dr_buf) {
+			dr->dr_nsecs += diskq[i].dr_nsecs;
+			for (ndiskq--; i < ndiskq; i++)
+				diskq[i] = diskq[i+1];
+		}
+		return;
+	}
+	if (i < ndiskq && secno + nsecs == diskq[i].dr_secno
+	&&  src + nsecs * BY2SECT == diskq[i].dr_buf) {
+		diskq[i].dr_secno = secno;
+		diskq[i].dr_nsecs += nsecs;
+		diskq[i].dr_buf = src;
+		return;
+	}
+
+	for (n = ndiskq++; n > i; n--)
+		diskq[n] = diskq[n-1];
+	diskq[i].dr_secno = secno;
+	diskq[i].dr_nsecs = nsecs;
+	diskq[i].dr_buf = src;
+}
+
+// Return the number of queued writes.
+int
+ide_pending(void)
+{
+	return ndiskq;
+}
+
+// Carry out the next queued write in elevator order: the first one at
+// or past the last sector written, wrapping around to the lowest.
+void
+ide_poll(void)
+{
+	u_int i;
+
+	if (ndiskq == 0)
+		return;
+	for (i = 0; i < ndiskq && diskq[i].dr_secno < diskhead; i++)
+		;
+	ide_done(i < ndiskq ? i : 0);
+}
+
+// Carry out every queued write.
+void
+ide_flush(void)
+{
+	while (ndiskq)
+		ide_poll();
+}
@@ -27,19 +27,129 @@ struct Open {
 	/** Virtual address of the Filefd page assigned to the descriptor.
 	 */
 	struct Filefd *o_ff;	
+	/** Block of the file a sequential reader maps next.
+	 */
+	u_int o_ranext;
+	/** Read-ahead window in blocks, `0` while access looks random.
+	 */
+	u_int o_rawin;
+	/** First block of the file not read ahead yet.
+	 */
+	u_int o_ramark;
+	/** Index + 1 of the next entry on the free list, `0` ends it.
+	 */
+	u_short o_next;
+	/** Whether the entry is on the free list.
+	 */
+	u_char o_free;
 };
 
 /// Max number of open files in the file system at once
 #define MAXOPEN	1024
+/// Read-ahead window of a file once it is read sequentially
+#define RA_MIN	2
+/// Largest read-ahead window
+#define RA_MAX	32
+/// Requests served between two write-backs of deferred size changes
+#define META_PERIOD	256
 /// Base address to map open file descriptor's Filefd pages.
 #define FILEVA 0x60000000
 
 /// Array of oepn file descriptors.
 struct Open opentab[MAXOPEN] = { { 0, 0, 1 } };
 
+/** Counters of the open file table.
+ */
+struct Openstat {
+	u_int os_allocs;	//!< Entries handed out by open_alloc().
+	u_int os_peak;		//!< Most entries off the free list at once.
+	u_int os_reclaims;	//!< Entries open_reclaim() found left without a close.
+	u_int os_scans;		//!< Scans of #opentab by open_reclaim().
+} openstat;
+
+static u_short open_head;	//!< Index + 1 of the first entry on the free list.
+static u_short open_tail;	//!< Index + 1 of the last entry on the free list.
+static u_int open_nfree;	//!< Number of entries on the free list.
+
 /// Virtual address at which to receive page containing client requests.
 #define REQVA	0x0ffff000
 
+/** Submission and completion rings of a client.
+ */
+struct Ring {
+	u_int r_envid;		//!< Client owning the rings, 0 if the slot is free.
+	struct Fsring_sq *r_sq;	//!< Where its submission ring is mapped.
+	struct Fsring_cq *r_cq;	//!< Where its completion ring is mapped.
+};
+
+/// Max number of clients with rings at once
+#define NRING	16
+/// Base address to map the rings of clients, two pages each.
+#define RINGVA	0x0f000000
+
+/// Array of client rings.
+struct Ring ringtab[NRING];
+
+/** Put an open file descriptor at the tail of the free list.
+ *
+ * Do nothing if it is on the list already. Being on the list does not make
+ * an entry free: it may still be shared by processes that have not closed
+ * it, so open_alloc() checks its Filefd page before reusing it.
+ *
+ * @param[in] o Pointer to the open file descriptor.
+ */
+static void
+open_free(struct Open *o)
+{
+	u_int i;
+
+	if (o->o_free)
+		return;
+	i = o - opentab;
+	o->o_free = 1;
+	o->o_next = 0;
+	if (open_tail)
+		opentab[open_tail-1].o_next = i + 1;
+	else
+		open_head = i + 1;
+	open_tail = i + 1;
+	open_nfree++;
+}
+
+/** Take the open file descriptor at the head of the free list.
+ *
+ * \pre The list is not empty.
+ */
+static struct Open *
+open_take(void)
+{
+	struct Open *o;
+
+	o = &opentab[open_head-1];
+	open_head = o->o_next;
+	if (open_head == 0)
+		open_tail = 0;
+	o->o_free = 0;
+	open_nfree--;
+	return o;
+}
+
+/** Put the open file descriptors that were never closed but have no
+ * holders left, because their processes exited, on the free list.
+ */
+static void
+open_reclaim(void)
+{
+	int i;
+
+	openstat.os_scans++;
+	for (i = 0; i < MAXOPEN; i++)
+		if (!opentab[i].o_free && pageref(opentab[i].o_ff) <= 1) {
+			open_free(&opentab[i]);
+			openstat.os_reclaims++;
+		}
+}
+
 /** Initialize array opentab.
  *
  * Set `opentab[i].o_fileid` to `i` and assign virtual address where open
@@ -55,17 +165,29 @@ serve_init(void)
 	for (i=0; i<MAXOPEN; i++) {
 		opentab[i].o_fileid = i;
 		opentab[i].o_ff = (struct Filefd*)va;
+		open_free(&opentab[i]);
 		va += BY2PG;
 	}
+
+	va = RINGVA;
+	for (i=0; i<NRING; i++) {
+		ringtab[i].r_sq = (struct Fsring_sq*)va;
+		ringtab[i].r_cq = (struct Fsring_cq*)(va + BY2PG);
+		va += 2*BY2PG;
+	}
 }
 
 /** Allocate an open file descriptor.
  *
- * The function tries to find an empty open file descriptor. If a descriptor is
- * blank, map a physic page as Filefd page to virtual address `o_ff` via
- * syscall_mem_alloc. If the allocation failed, return an error code.
+ * The descriptor comes from the head of the free list, which serve_close()
+ * feeds. Entries on it that are still shared by some process go back to
+ * the tail. Only when no entry on the list is usable is the whole table
+ * scanned, by open_reclaim(), for entries whose processes exited without
+ * closing them.
  *
- * If a descriptor already has a Filefd page and no others use it, it is
+ * If the descriptor is blank, map a physic page as Filefd page to virtual
+ * address `o_ff` via syscall_mem_alloc. If the allocation failed, return an
+ * error code. If it already has a Filefd page and no others use it, it is
  * 'clean'.
  *
  * Finally clear the page via user_bzero, save the descriptor address to the
@@ -81,24 +203,52 @@ serve_init(void)
 int
 open_alloc(struct Open **o)
 {
-	int i, r;
+	struct Open *op;
+	u_int n, scanned;
+	int r;
 
 	// Find an available open-file table entry
-	for (i = 0; i < MAXOPEN; i++) {
-		switch (pageref(opentab[i].o_ff)) {
-		case 0:
-			//writef("^^^^^^^^^^^^^^^^ (u_int)opentab[i].o_ff: %x\n",(u_int)opentab[i].o_ff);
-			if ((r = syscall_mem_alloc(0, (u_int)opentab[i].o_ff, PTE_V|PTE_R|PTE_LIBRARY)) < 0)
-				return r;
-			
-		case 1:
-			opentab[i].o_fileid += MAXOPEN;
-			*o = &opentab[i];
-			user_bzero((void*)opentab[i].o_ff, BY2PG);
-			return (*o)->o_fileid;
+	for (scanned = 0; ; scanned = 1) {
+		for (n = open_nfree; n > 0; n--) {
+			op = open_take();
+			if (pageref(op->o_ff) <= 1)
+				goto found;
+			open_free(op);
 		}
+		if (scanned)
+			return -E_MAX_OPEN;
+		open_reclaim();
 	}
-	return -E_MAX_OPEN;
+
+found:
+	switch (pageref(op->o_ff)) {
+	case 0:
+		//writef("^^^^^^^^^^^^^^^^ (u_int)op->o_ff: %x\n",(u_int)op->o_ff);
+		if ((r = syscall_mem_alloc(0, (u_int)op->o_ff, PTE_V|PTE_R|PTE_LIBRARY)) < 0) {
+			open_free(op);
+			return r;
+		}
+
+	case 1:
+		// the last holder is gone; let its blocks leave the cache
+		if (op->o_file) {
+			if (op->o_file->f_dir)
+				block_unpin(op->o_file->f_dir);
+			block_unpin(op->o_file);
+			op->o_file = 0;
+		}
+		op->o_fileid += MAXOPEN;
+		op->o_ranext = 0;
+		op->o_rawin = 0;
+		op->o_ramark = 0;
+		user_bzero((void*)op->o_ff, BY2PG);
+	}
+
+	openstat.os_allocs++;
+	if (MAXOPEN - open_nfree > openstat.os_peak)
+		openstat.os_peak = MAXOPEN - open_nfree;
+	*o = op;
+	return op->o_fileid;
 }
 
 /**
@@ -127,8 +277,70 @@ open_lookup(u_int envid, u_int fileid, struct Open **po)
 }
 
 // Serve requests, sending responses back to envid.
-// To send a result back, ipc_send(envid, r, 0, 0).
-// To include a page, ipc_send(envid, r, srcva, perm).
+// To send a result back, serve_reply(envid, r, 0, 0).
+// To include a page, serve_reply(envid, r, srcva, perm).
+// The reply goes out with the next ipc_reply_wait() of serve().
+
+static struct {
+	u_int envid;	// client to answer, 0 if none
+	u_int value;
+	u_int srcva;
+	u_int perm;
+} reply;
+
+static void
+serve_reply(u_int envid, u_int value, u_int srcva, u_int perm)
+{
+	reply.envid = envid;
+	reply.value = value;
+	reply.srcva = srcva;
+	reply.perm = perm;
+}
+
+// Blocks to read ahead once the reply is out, see serve_readahead().
+static struct {
+	struct File *f;	// 0 if none
+	u_int from;
+	u_int to;
+} readahead;
+
+/** Note that block `filebno` of an open file was mapped, and plan
+ * read-ahead if the file is being read sequentially.
+ *
+ * Each access right after the previous one doubles the window, from
+ * #RA_MIN up to #RA_MAX; any other access closes it. Only blocks past
+ * those already read ahead are planned. serve() reads them after sending
+ * the reply, so the client runs while the disk is read.
+ *
+ * @param[in] o %Open file.
+ * @param[in] filebno Block of the file that was mapped.
+ */
+static void
+serve_readahead(struct Open *o, u_int filebno)
+{
+	u_int from, to;
+
+	if (filebno == o->o_ranext)
+		o->o_rawin = o->o_rawin ? MIN(2*o->o_rawin, RA_MAX) : RA_MIN;
+	else {
+		o->o_rawin = 0;
+		o->o_ramark = 0;
+	}
+	o->o_ranext = filebno + 1;
+	if (o->o_rawin == 0)
+		return;
+
+	from = filebno + 1;
+	if (o->o_ramark > from)
+		from = o->o_ramark;
+	to = filebno + 1 + o->o_rawin;
+	if (from >= to)
+		return;
+	o->o_ramark = to;
+	readahead.f = o->o_file;
+	readahead.from = from;
+	readahead.to = to;
+}
 
 /** Serve open requests from other process.
  *
@@ -136,7 +348,7 @@ open_lookup(u_int envid, u_int fileid, struct Open **po)
  * descriptor properly.
  *
  * If any step failed, the server will panic and send an error code to reqeust
- * process via ipc_send().
+ * process via serve_reply().
  *
  * If success, send `0` and the Filefd page to request process.
  *
@@ -175,8 +387,12 @@ serve_open(u_int envid, struct Fsreq_open *rq)
 		goto out;
 	}
 //writef("serve_open:ending open the file\n");
-	// Save the file pointer.
+	// Save the file pointer. The server uses f (and its directory) by
+	// pointer until the entry is reused, so their blocks stay cached:
+	// file_open() left f pinned, the directory is pinned here.
 	o->o_file = f;
+	if (f->f_dir)
+		block_pin(f->f_dir);
 
 	// Fill out the Filefd structure
 	ff = (struct Filefd*)o->o_ff;
@@ -187,11 +403,11 @@ serve_open(u_int envid, struct Fsreq_open *rq)
 	ff->f_fd.fd_dev_id = devfile.dev_id;
 //writef("serve_open:will to ipc send\n");
 	if (debug) writef("sending success, page %08x\n", (u_int)o->o_ff);
-	ipc_send(envid, 0, (u_int)o->o_ff, PTE_V|PTE_R|PTE_LIBRARY);
+	serve_reply(envid, 0, (u_int)o->o_ff, PTE_V|PTE_R|PTE_LIBRARY);
 //writef("serve_open:end of open %s\n",rq->req_path);
 	return;
 out:user_panic("*********************path:%s",path);
-	ipc_send(envid, r, 0, 0);
+	serve_reply(envid, r, 0, 0);
 }
 
 /** Serve map requests from other process.
@@ -220,22 +436,72 @@ serve_map(u_int envid, struct Fsreq_map *rq)
 	// Your code here
 	if((r = open_lookup(envid, rq->req_fileid, &pOpen))<0)
 	{
-		ipc_send(envid,r,0,0);
+		serve_reply(envid,r,0,0);
 		return;
 	}
 	
 	filebno = rq->req_offset/BY2BLK;
 	if((r = file_get_block(pOpen->o_file, filebno, &blk))<0)
 	{
-		ipc_send(envid,r,0,0);
+		serve_reply(envid,r,0,0);
 		return;
 	}
+	serve_readahead(pOpen, filebno);
 
-	ipc_send(envid, 0, blk, PTE_V|PTE_R|PTE_LIBRARY);
+	serve_reply(envid, 0, blk, PTE_V|PTE_DTRACK|PTE_LIBRARY);
 	return;
 //	user_panic("serve_map not implemented");
 }
 
+/** Serve map range requests from other process.
+ *
+ * Map every block of the file from `req_offset` up to `req_end` into the
+ * requesting process, starting at `req_va`, by mapping the pages into its
+ * address space directly. A whole file costs the client one round trip.
+ *
+ * Send `0` back if all blocks are mapped, otherwise an error code (blocks
+ * before the failing one stay mapped).
+ *
+ * @param[in] envid Request environment id.
+ * @param[in] rq Map range request.
+ */
+void
+serve_map_range(u_int envid, struct Fsreq_map_range *rq)
+{
+	if (debug) writef("serve_map_range %08x %08x %08x %08x\n", envid, rq->req_fileid, rq->req_offset, rq->req_end);
+
+	struct Open *pOpen;
+	u_int off, va;
+	void *blk;
+	int r;
+
+	if((r = open_lookup(envid, rq->req_fileid, &pOpen))<0)
+	{
+		serve_reply(envid,r,0,0);
+		return;
+	}
+	if((rq->req_offset | rq->req_va) & (BY2BLK-1)
+	|| rq->req_end < rq->req_offset || rq->req_end - rq->req_offset > MAXFILESIZE
+	|| rq->req_va >= UTOP || UTOP - rq->req_va < rq->req_end - rq->req_offset)
+	{
+		serve_reply(envid,-E_INVAL,0,0);
+		return;
+	}
+
+	va = rq->req_va;
+	for(off = rq->req_offset; off < rq->req_end; off += BY2BLK, va += BY2BLK)
+	{
+		if((r = file_get_block(pOpen->o_file, off/BY2BLK, &blk))<0
+		|| (r = syscall_mem_map(0, (u_int)blk, envid, va, PTE_V|PTE_DTRACK|PTE_LIBRARY))<0)
+		{
+			serve_reply(envid,r,0,0);
+			return;
+		}
+	}
+
+	serve_reply(envid, 0, 0, 0);
+}
+
 /** Serve set size requests.
  *
  * Set the size of the sepicified file to the given one via file_set_size().
@@ -256,17 +522,17 @@ serve_set_size(u_int envid, struct Fsreq_set_size *rq)
         // Your code here
         if((r = open_lookup(envid, rq->req_fileid, &pOpen))<0)
         {
-                ipc_send(envid,r,0,0);
+                serve_reply(envid,r,0,0);
                 return;
         }
 	
 	if((r = file_set_size(pOpen->o_file, rq->req_size))<0)
 	{
-		ipc_send(envid,r,0,0);
+		serve_reply(envid,r,0,0);
 		return;
 	}
 
-	ipc_send(envid, 0, 0, 0);//PTE_V);
+	serve_reply(envid, 0, 0, 0);//PTE_V);
 	return;
 //	user_panic("serve_set_size not implemented");
 }
@@ -291,12 +557,13 @@ serve_close(u_int envid, struct Fsreq_close *rq)
         int r;
         if((r = open_lookup(envid, rq->req_fileid, &pOpen))<0)
         {
-                ipc_send(envid,r,0,0);
+                serve_reply(envid,r,0,0);
                 return;
         }
 //writef("serve_close:pOpen = %x\n",pOpen);	
-	file_close(pOpen->o_file);
-	ipc_send(envid, 0, 0, 0);//PTE_V);
+	r = file_close(pOpen->o_file);
+	open_free(pOpen);
+	serve_reply(envid, r, 0, 0);//PTE_V);
 	
 //	syscall_mem_unmap(0, (u_int)pOpen);
 	return;		
@@ -329,11 +596,11 @@ serve_remove(u_int envid, struct Fsreq_remove *rq)
 	
 	if((r = file_remove(path))<0)
         {
-                ipc_send(envid,r,0,0);
+                serve_reply(envid,r,0,0);
                 return;
         }
 	
-	ipc_send(envid, 0, 0, 0);//PTE_V);
+	serve_reply(envid, 0, 0, 0);//PTE_V);
 //	user_panic("serve_remove not implemented");
 }
 
@@ -359,86 +626,268 @@ serve_dirty(u_int envid, struct Fsreq_dirty *rq)
         int r;
         if((r = open_lookup(envid, rq->req_fileid, &pOpen))<0)
         {
-                ipc_send(envid,r,0,0);
+                serve_reply(envid,r,0,0);
                 return;
         }
 
 	if((r = file_dirty(pOpen->o_file, rq->req_offset))<0)
 	{
-		ipc_send(envid,r,0,0);
+		serve_reply(envid,r,0,0);
                 return;
 	}
 
-	ipc_send(envid, 0, 0, 0);
+	serve_reply(envid, 0, 0, 0);
 	return;
 //	user_panic("serve_dirty not implemented");
 }
 
 /** Serve synchronization requests.
  *
- * Synchronize whole file system via fs_sync(), and send `0` back.
+ * Synchronize whole file system via fs_sync(), and send its result back.
  *
  * @param[in] envid Request environment id.
  */
 void
 serve_sync(u_int envid)
 {
-	fs_sync();
-	ipc_send(envid, 0, 0, 0);
+	int r;
+
+	r = fs_sync();
+	ide_flush();
+	if (debug) writef("serve_sync: cache %d hits %d misses %d evicts %d writebacks\n",
+			bcstat.bs_hits, bcstat.bs_misses, bcstat.bs_evicts, bcstat.bs_writebacks);
+	if (debug) writef("serve_sync: read ahead %d used %d wasted %d\n",
+			bcstat.bs_ra, bcstat.bs_rahits, bcstat.bs_rawaste);
+	if (debug) writef("serve_sync: open %d peak %d allocs %d reclaimed %d scans %d\n",
+			MAXOPEN - open_nfree, openstat.os_peak, openstat.os_allocs,
+			openstat.os_reclaims, openstat.os_scans);
+	serve_reply(envid, r, 0, 0);
+}
+
+/** Serve ring setup requests.
+ *
+ * Map the client's submission and completion pages into a free slot of
+ * #ringtab (or the client's old one). Slots of clients that have exited
+ * are reused.
+ *
+ * @param[in] envid Request environment id.
+ * @param[in] rq Ring request, with the addresses of both pages in the client.
+ */
+void
+serve_ring(u_int envid, struct Fsreq_ring *rq)
+{
+	struct Ring *rg, *free;
+	struct Env *e;
+	int i, r;
+
+	if ((rq->req_sqva | rq->req_cqva) & (BY2PG-1)
+	||  rq->req_sqva >= UTOP || rq->req_cqva >= UTOP) {
+		serve_reply(envid, -E_INVAL, 0, 0);
+		return;
+	}
+
+	free = 0;
+	for (i = 0; i < NRING; i++) {
+		rg = &ringtab[i];
+		if (rg->r_envid == envid) {
+			free = rg;
+			break;
+		}
+		e = &envs[ENVX(rg->r_envid)];
+		if (!free && (rg->r_envid == 0 || e->env_id != rg->r_envid
+				|| e->env_status == ENV_FREE))
+			free = rg;
+	}
+	if (!free) {
+		serve_reply(envid, -E_MAX_OPEN, 0, 0);
+		return;
+	}
+
+	if ((r = syscall_mem_map(envid, rq->req_sqva, 0, (u_int)free->r_sq, PTE_V|PTE_R|PTE_LIBRARY)) < 0
+	||  (r = syscall_mem_map(envid, rq->req_cqva, 0, (u_int)free->r_cq, PTE_V|PTE_R|PTE_LIBRARY)) < 0) {
+		serve_reply(envid, r, 0, 0);
+		return;
+	}
+	free->r_envid = envid;
+	serve_reply(envid, 0, 0, 0);
+}
+
+/** Carry out one submission of a client's ring.
+ *
+ * Return what the corresponding IPC request would have replied. For
+ * #FSREQ_MAP the block is mapped into the client at `sqe_va` directly.
+ *
+ * `sqe` must be the server's own copy: the client can still write the
+ * ring while its fields are checked and used.
+ */
+static int
+serve_ring_op(u_int envid, struct Ring *rg, const struct Fsring_sqe *sqe)
+{
+	struct Open *o;
+	char path[MAXPATHLEN];
+	void *blk;
+	int r;
+
+	if (sqe->sqe_type == FSREQ_REMOVE) {
+		if (sqe->sqe_arg >= NFSRING_PATH)
+			return -E_INVAL;
+		user_bcopy(rg->r_sq->sq_path[sqe->sqe_arg], path, MAXPATHLEN);
+		path[MAXPATHLEN-1] = 0;
+		return file_remove(path);
+	}
+
+	if ((r = open_lookup(envid, sqe->sqe_fileid, &o)) < 0)
+		return r;
+
+	switch (sqe->sqe_type) {
+	case FSREQ_MAP:
+		if ((sqe->sqe_va & (BY2PG-1)) || sqe->sqe_va >= UTOP)
+			return -E_INVAL;
+		if ((r = file_get_block(o->o_file, sqe->sqe_arg/BY2BLK, &blk)) < 0)
+			return r;
+		serve_readahead(o, sqe->sqe_arg/BY2BLK);
+		return syscall_mem_map(0, (u_int)blk, envid, sqe->sqe_va, PTE_V|PTE_DTRACK|PTE_LIBRARY);
+	case FSREQ_SET_SIZE:
+		return file_set_size(o->o_file, sqe->sqe_arg);
+	case FSREQ_DIRTY:
+		return file_dirty(o->o_file, sqe->sqe_arg);
+	case FSREQ_STAT:
+		return o->o_file->f_size;
+	default:
+		return -E_INVAL;
+	}
+}
+
+/** Serve ring enter requests.
+ *
+ * Work through the client's pending submissions, as long as its
+ * completion ring has room, and reply with the number of completions
+ * posted. One request thus covers a whole batch.
+ *
+ * @param[in] envid Request environment id.
+ */
+void
+serve_ring_enter(u_int envid)
+{
+	struct Ring *rg;
+	struct Fsring_sq *sq;
+	struct Fsring_cq *cq;
+	struct Fsring_sqe sqe;
+	struct Fsring_cqe *cqe;
+	int i, n;
+
+	for (i = 0; i < NRING; i++)
+		if (ringtab[i].r_envid == envid)
+			break;
+	if (i == NRING) {
+		serve_reply(envid, -E_INVAL, 0, 0);
+		return;
+	}
+	rg = &ringtab[i];
+	sq = rg->r_sq;
+	cq = rg->r_cq;
+
+	for (n = 0; sq->sq_head != sq->sq_tail
+			&& cq->cq_tail - cq->cq_head < NFSRING_ENT; n++) {
+		user_bcopy(&sq->sq_ent[sq->sq_head % NFSRING_ENT], &sqe, sizeof(sqe));
+		cqe = &cq->cq_ent[cq->cq_tail % NFSRING_ENT];
+		cqe->cqe_res = serve_ring_op(envid, rg, &sqe);
+		cqe->cqe_data = sqe.sqe_data;
+		cq->cq_tail++;
+		sq->sq_head++;
+	}
+	serve_reply(envid, n, 0, 0);
 }
 
 /** Server's main loop.
  * 
- * Wait requests via ipc_recv() and handle it depending on type code.
+ * Wait requests via ipc_reply_wait() and handle it depending on type code.
  *
- * At each end of loop, unmap the reception page to allow ipc_recv() map new
- * request.
+ * Each ipc_reply_wait() sends the reply to the previous request and takes
+ * the next one, so a request costs the server a single system call. A new
+ * request page simply replaces the previous one at REQVA.
  *
  */
 void
 serve(void)
 {
-	u_int req, whom, perm;
+	u_int req, whom, perm, nserved;
+	void *rq;
+
+	nserved = 0;
 	for(;;) {
 		perm = 0;
 
-		req = ipc_recv(&whom, REQVA, &perm);
-		
+		if (++nserved % META_PERIOD == 0)
+			meta_flush();
+
+		if (readahead.f || ide_pending()) {
+			// answer first, so the client is not kept waiting on
+			// the read-ahead and write-back done below before the
+			// next request; like ipc_reply_wait(), never wait for a
+			// client that is not receiving
+			if (reply.envid)
+				syscall_ipc_can_send(reply.envid, reply.value,
+					reply.srcva, reply.perm);
+			reply.envid = 0;
+			if (readahead.f)
+				file_readahead(readahead.f, readahead.from, readahead.to);
+			readahead.f = 0;
+			// queued writes go out while no request is waiting
+			while (ide_pending() && env->env_senders.tqh_first == 0)
+				ide_poll();
+		}
+
+		req = ipc_reply_wait(reply.envid, reply.value, reply.srcva,
+			reply.perm, 0, &whom, REQVA, &perm);
+		reply.envid = 0;
 
-		// All requests must contain an argument page
-		if (!(perm & PTE_V)) {
+		// Small requests come inline in env_ipc_msg, the others
+		// (those carrying a path) in an argument page at REQVA.
+		if (perm & PTE_V)
+			rq = (void*)REQVA;
+		else if (req == FSREQ_OPEN || req == FSREQ_REMOVE) {
 			writef("Invalid request from %08x: no argument page\n",
 				whom);
 			continue; // just leave it hanging...
-		}
+		} else
+			rq = env->env_ipc_msg;
 
 		switch (req) {
 		case FSREQ_OPEN:
-			serve_open(whom, (struct Fsreq_open*)REQVA);
+			serve_open(whom, (struct Fsreq_open*)rq);
 			break;
 		case FSREQ_MAP:
-			serve_map(whom, (struct Fsreq_map*)REQVA);
+			serve_map(whom, (struct Fsreq_map*)rq);
+			break;
+		case FSREQ_MAP_RANGE:
+			serve_map_range(whom, (struct Fsreq_map_range*)rq);
 			break;
 		case FSREQ_SET_SIZE:
-			serve_set_size(whom, (struct Fsreq_set_size*)REQVA);
+			serve_set_size(whom, (struct Fsreq_set_size*)rq);
 			break;
 		case FSREQ_CLOSE:
-			serve_close(whom, (struct Fsreq_close*)REQVA);
+			serve_close(whom, (struct Fsreq_close*)rq);
 			break;
 		case FSREQ_DIRTY:
-			serve_dirty(whom, (struct Fsreq_dirty*)REQVA);
+			serve_dirty(whom, (struct Fsreq_dirty*)rq);
 			break;
 		case FSREQ_REMOVE:
-			serve_remove(whom, (struct Fsreq_remove*)REQVA);
+			serve_remove(whom, (struct Fsreq_remove*)rq);
 			break;
 		case FSREQ_SYNC:
 			serve_sync(whom);
 			break;
+		case FSREQ_RING:
+			serve_ring(whom, (struct Fsreq_ring*)rq);
+			break;
+		case FSREQ_RING_ENTER:
+			serve_ring_enter(whom);
+			break;
 		default:
 			writef("Invalid request code %d from %08x\n", whom, req);
 			break;
 		}
-		syscall_mem_unmap(0, REQVA);
 	}
 }
 
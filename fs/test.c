@@ -49,27 +49,28 @@ fs_test(void)
 	writef("file_get_block is good\n");
 
 	*(volatile char*)blk = *(volatile char*)blk;
-	//^^^user_assert(((* vpt)[VPN(blk)]&PTE_D));
+	user_assert(((* vpt)[VPN(blk)]&PTE_D));
 	file_flush(f);
-	//^^^user_assert(!((* vpt)[VPN(blk)]&PTE_D));
+	user_assert(!((* vpt)[VPN(blk)]&PTE_D));
 	writef("file_flush is good\n");
 
 	if ((r = file_set_size(f, 0)) < 0)
 		user_panic("file_set_size: %e", r);
 	user_assert(f->f_direct[0] == 0);
-	//^^^user_assert(!((* vpt)[VPN(f)]&PTE_D));
+	user_assert(!((* vpt)[VPN(f)]&PTE_D));
 	writef("file_truncate is good\n");
 
 	if ((r = file_set_size(f, strlen(msg))) < 0)
 		user_panic("file_set_size 2: %e", r);
-	//^^^user_assert(!((* vpt)[VPN(f)]&PTE_D));user_panic("##########################");
+	user_assert(!((* vpt)[VPN(f)]&PTE_D));
 	if ((r = file_get_block(f, 0, &blk)) < 0)
 		user_panic("file_get_block 2: %e", r);
 	strcpy((char*)blk, msg);	
-	//^^^user_assert(((* vpt)[VPN(blk)]&PTE_D));
+	user_assert(((* vpt)[VPN(blk)]&PTE_D));
 	file_flush(f);
-	//^^^user_assert(!((* vpt)[VPN(blk)]&PTE_D));
+	user_assert(!((* vpt)[VPN(blk)]&PTE_D));
 	file_close(f);
-	//^^^user_assert(!((* vpt)[VPN(f)]&PTE_D));	
+	user_assert(!((* vpt)[VPN(f)]&PTE_D));	
+	block_unpin(f);
 	writef("file rewrite is good\n");
 }
@@ -18,6 +18,31 @@
 #define ENV_RUNNABLE		1
 #define ENV_NOT_RUNNABLE	2
 
+// Words of inline payload an IPC message may carry
+#define IPC_MSGWORDS	16
+
+// Lazily-paged regions of an address space: a few for the program
+// image and the files and mmap() regions a process usually has. A file
+// opened with all of them taken is mapped up front instead.
+#define NLAZYSEG	16
+
+/* A region whose pages are brought in from a file on first touch.
+ * A TLB miss inside [ls_va, ls_end) is turned by the kernel into an
+ * FSREQ_MAP request to ls_pager on behalf of the faulting env; pages
+ * at or past ls_fileend are zero-filled without asking anybody.
+ * With PTE_LIBRARY in ls_perm the pager's pages are shared as they are
+ * (open files); otherwise writable and partial pages are private copies.
+ */
+struct Lazyseg {
+	u_int ls_va;			// page-aligned start of the region
+	u_int ls_end;			// page-aligned end, 0 if the slot is free
+	u_int ls_fileend;		// va at which the file data ends
+	u_int ls_offset;		// file offset backing ls_va
+	u_int ls_fileid;		// file server id of the backing file
+	u_int ls_pager;			// envid of the file server
+	u_int ls_perm;			// perm the pages are mapped with
+};
+
 struct Env {
 	struct Trapframe env_tf;        // Saved registers
 	LIST_ENTRY(Env) env_link;       // Free list
@@ -33,6 +58,19 @@ struct Env {
 	u_int env_ipc_recving;          // env is blocked receiving
 	u_int env_ipc_dstva;		// va at which to map received page
 	u_int env_ipc_perm;		// perm of page mapping received
+	u_int env_ipc_partner;		// only take messages from it, 0 if any
+	u_int env_ipc_msg[IPC_MSGWORDS];	// inline payload received
+
+	// Blocking IPC
+	TAILQ_ENTRY(Env) env_send_link;	// senders queue of env_send_to
+	TAILQ_HEAD(, Env) env_senders;	// envs blocked sending to us
+	u_int env_send_to;		// envid blocked sending to, 0 if none
+	u_int env_send_value;		// value being sent
+	struct Page *env_send_page;	// page being sent, NULL if none
+	u_int env_send_perm;		// perm of the page being sent
+	u_int env_send_call;		// wait for the reply after delivery
+	u_int env_send_inline;		// env_send_msg goes along
+	u_int env_send_msg[IPC_MSGWORDS];	// inline payload being sent
 
 	// Lab 4 fault handling
 	u_int env_pgfault_handler;      // page fault state
@@ -40,6 +78,14 @@ struct Env {
 
 	// Lab 6 scheduler counts
 	u_int env_runs;			// number of times been env_run'ed
+
+	// Demand paging
+	struct Lazyseg env_lazyseg[NLAZYSEG];	// lazily-paged regions
+	u_int env_lazy_va;		// page waiting for the pager, 0 if none
+
+	// Wait queues
+	LIST_ENTRY(Env) env_wait_link;	// wait queue of env_wait_pa
+	u_int env_wait_pa;		// physical address slept on, 0 if none
 };
 
 LIST_HEAD(Env_list, Env);
@@ -55,6 +101,14 @@ void env_destroy(struct Env *e);
 int envid2env(u_int envid, struct Env **penv, int checkperm);
 void env_run(struct Env *e);
 
+int lazy_fault(u_int va);
+
+void ipc_cancel(struct Env *e);
+
+void env_wait(struct Env *e, u_int pa);
+int env_wake(u_int pa, int n);
+void env_wake_page(u_int pa);
+
 
 // for the grading script
 #define ENV_CREATE2(x, y) \
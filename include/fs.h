@@ -29,8 +29,16 @@
 /// Number of all block pointers in a File structure.
 #define NINDIRECT	(BY2BLK/4)
 
-/// Maximum size of a file.
-#define MAXFILESIZE	(NINDIRECT*BY2BLK)
+/// Number of blocks reached through the double-indirect block.
+#define NDINDIRECT	(NINDIRECT*NINDIRECT)
+
+/** Maximum size of a file.
+ *
+ * The double-indirect block reaches far more, but a process maps each open
+ * file whole into a window of this size (see INDEX2DATA()), and the windows
+ * of all its fds must fit below the stack.
+ */
+#define MAXFILESIZE	(2*NINDIRECT*BY2BLK)
 
 /// Bytes of a File structure.
 #define BY2FILE 256
@@ -63,11 +71,46 @@ struct File {
 	 * __The field is only valid in memory.__
 	 */
 	struct File *f_dir;		// valid only in memory
+	/** %File flags, see #FFLAG_EXTENT.
+	 */
+	u_int f_flags;
+	/** Block of the hash index of a directory, `0` if it has none.
+	 */
+	u_int f_dindex;
+	/** Next entry on the same hash chain of the parent directory's index, as
+	 * its index in the directory plus one, `0` at the end of the chain.
+	 */
+	u_int f_hnext;
+	/** Double-indirect block pointer, for the blocks from NINDIRECT on.
+	 *
+	 * Each block number in it is of an indirect block of NINDIRECT more.
+	 */
+	u_int f_dindirect;
 	/** Padding to make size be BY2FILE bytes.
 	 */
-	u_char f_pad[256-MAXNAMELEN-4-4-NDIRECT*4-4-4];
+	u_char f_pad[256-MAXNAMELEN-4-4-NDIRECT*4-4-4-4-4-4-4];
 };
 
+/// f_direct and f_indirect hold extents instead of block pointers
+#define FFLAG_EXTENT	0x1
+
+/** A run of blocks of a file that lie one after another on disk.
+ *
+ * In a file with #FFLAG_EXTENT, the first #NDEXTENT extents take the place
+ * of f_direct and the rest fill the block f_indirect points to. Extents are
+ * kept sorted by e_fileb; the first one with e_len 0 ends the list.
+ */
+struct Extent {
+	u_int e_start;		//!< First disk block.
+	u_short e_fileb;	//!< Block of the file the extent begins at.
+	u_short e_len;		//!< Number of blocks.
+};
+
+/// Number of extents held in a File structure.
+#define NDEXTENT	(NDIRECT*4/sizeof(struct Extent))
+/// Number of extents held in the extent block.
+#define NIEXTENT	(BY2BLK/sizeof(struct Extent))
+
 /** Number of File structure in a block.
  */
 #define FILE2BLK	(BY2BLK/sizeof(struct File))
@@ -100,6 +143,10 @@ struct Super {
 #define FSREQ_DIRTY	5
 #define FSREQ_REMOVE	6
 #define FSREQ_SYNC	7
+#define FSREQ_RING	8	// register a client's rings, inline {sq va, cq va}
+#define FSREQ_RING_ENTER 9	// process the client's pending submissions
+#define FSREQ_STAT	10	// ring only: completes with the file size
+#define FSREQ_MAP_RANGE	11	// map [offset, end) of a file into the client
 
 struct Fsreq_open {
 	char req_path[MAXPATHLEN];
@@ -111,6 +158,13 @@ struct Fsreq_map {
 	u_int req_offset;
 };
 
+struct Fsreq_map_range {
+	int req_fileid;
+	u_int req_offset;	// block-aligned start
+	u_int req_end;		// end offset, rounded up to a block
+	u_int req_va;		// client address of the block at req_offset
+};
+
 struct Fsreq_set_size {
 	int req_fileid;
 	u_int req_size;
@@ -129,4 +183,41 @@ struct Fsreq_remove {
 	u_char req_path[MAXPATHLEN];
 };
 
+struct Fsreq_ring {
+	u_int req_sqva;
+	u_int req_cqva;
+};
+
+// Submission/completion rings a client shares with the file server.
+// Ring positions run freely; an entry lives at position % NFSRING_ENT.
+
+#define NFSRING_ENT	32	// entries per ring, a power of 2
+#define NFSRING_PATH	3	// path slots of the submission page
+
+struct Fsring_sqe {
+	u_int sqe_type;		// FSREQ_MAP, _SET_SIZE, _DIRTY, _STAT or _REMOVE
+	u_int sqe_fileid;
+	u_int sqe_arg;		// offset, size or path slot
+	u_int sqe_va;		// where FSREQ_MAP maps the block in the client
+	u_int sqe_data;		// handed back in the completion
+};
+
+struct Fsring_cqe {
+	int cqe_res;		// what the request would have replied
+	u_int cqe_data;		// sqe_data of the request
+};
+
+struct Fsring_sq {
+	u_int sq_head;		// advanced by the server
+	u_int sq_tail;		// advanced by the client
+	struct Fsring_sqe sq_ent[NFSRING_ENT];
+	char sq_path[NFSRING_PATH][MAXPATHLEN];
+};
+
+struct Fsring_cq {
+	u_int cq_head;		// advanced by the client
+	u_int cq_tail;		// advanced by the server
+	struct Fsring_cqe cq_ent[NFSRING_ENT];
+};
+
 #endif // _FS_H_
@@ -39,6 +39,7 @@
 #define PTE_COW		0x0001	// Copy On Write
 #define PTE_UC		0x0800	// unCached
 #define PTE_LIBRARY		0x0004	// share memmory
+#define PTE_DTRACK	0x0008	// writable, but mapped clean until the first write sets PTE_D
 /*
  * Part 2.  Our conventions.
  */
@@ -2,7 +2,7 @@
 #define UNISTD_H
 
 #define __SYSCALL_BASE 9527
-#define __NR_SYSCALLS 20
+#define __NR_SYSCALLS 22
 
 
 #define SYS_putchar 		((__SYSCALL_BASE ) + (0 ) ) 
@@ -20,4 +20,12 @@
 #define SYS_ipc_can_send		((__SYSCALL_BASE ) + (12 ) )
 #define SYS_ipc_recv		((__SYSCALL_BASE ) + (13 ) )
 #define SYS_cgetc			((__SYSCALL_BASE ) + (14 ) )
+#define SYS_lazy_map		((__SYSCALL_BASE ) + (15 ) )
+#define SYS_lazy_unmap		((__SYSCALL_BASE ) + (16 ) )
+#define SYS_wait_on		((__SYSCALL_BASE ) + (17 ) )
+#define SYS_wake		((__SYSCALL_BASE ) + (18 ) )
+#define SYS_ipc_send		((__SYSCALL_BASE ) + (19 ) )
+#define SYS_ipc_call		((__SYSCALL_BASE ) + (20 ) )
+#define SYS_ipc_reply_wait	((__SYSCALL_BASE ) + (21 ) )
+#define SYS_cputs		((__SYSCALL_BASE ) + (22 ) )
 #endif
@@ -14,6 +14,11 @@ struct Env *curenv = NULL;	        // the current env
 
 static struct Env_list env_free_list;	// Free list
 
+// Envs sleeping in sys_wait_on, hashed by the physical page they sleep on
+#define NWAITQ		64
+#define WAITQ(pa)	(&env_wait_queues[((pa) >> PGSHIFT) % NWAITQ])
+static struct Env_list env_wait_queues[NWAITQ];
+
 extern Pde *boot_pgdir;
 extern char *KERNEL_SP;
 
@@ -210,6 +215,13 @@ env_alloc(struct Env **new, u_int parent_id)
 	if(parent_id)
 		e->env_tf.cp0_status = 0x10001004;
 	e->env_tf.regs[29] = USTACKTOP;
+	bzero(e->env_lazyseg, sizeof(e->env_lazyseg));
+	e->env_lazy_va = 0;
+	e->env_wait_pa = 0;
+	e->env_ipc_partner = 0;
+	e->env_send_to = 0;
+	e->env_send_page = NULL;
+	TAILQ_INIT(&e->env_senders);
 
 
     /*Step 5: Remove the new Env from Env free list*/
@@ -397,6 +409,12 @@ env_free(struct Env *e)
     /* Hint: Note the environment's demise.*/
 	printf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	if (e->env_wait_pa) {
+		LIST_REMOVE(e, env_wait_link);
+		e->env_wait_pa = 0;
+	}
+	ipc_cancel(e);
+
     /* Hint: Flush all mapped pages in the user portion of the address space */
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
         /* Hint: only look at mapped page tables. */
@@ -423,6 +441,67 @@ env_free(struct Env *e)
     /* Hint: return the environment to the free list. */
 	e->env_status = ENV_FREE;
 	LIST_INSERT_HEAD(&env_free_list, e, env_link);
+
+	/* Hint: let wait() and blocked senders notice. */
+	env_wake(PADDR(&e->env_status), NENV);
+	env_wake(PADDR(&e->env_ipc_recving), NENV);
+}
+
+/* Overview:
+ *  Put env e to sleep on physical address pa until env_wake(pa, ...)
+ *  or env_wake_page() on its page. The caller yields afterwards.
+ */
+void
+env_wait(struct Env *e, u_int pa)
+{
+	e->env_wait_pa = pa;
+	e->env_status = ENV_NOT_RUNNABLE;
+	LIST_INSERT_HEAD(WAITQ(pa), e, env_wait_link);
+}
+
+/* Overview:
+ *  Wake at most n envs sleeping on physical address pa, most recent
+ *  sleepers first.
+ *
+ * Post-Condition:
+ *  Return the number of envs woken.
+ */
+int
+env_wake(u_int pa, int n)
+{
+	struct Env *e, *next;
+	int woken = 0;
+
+	for (e = LIST_FIRST(WAITQ(pa)); e && woken < n; e = next) {
+		next = LIST_NEXT(e, env_wait_link);
+		if (e->env_wait_pa != pa)
+			continue;
+		LIST_REMOVE(e, env_wait_link);
+		e->env_wait_pa = 0;
+		e->env_status = ENV_RUNNABLE;
+		woken++;
+	}
+	return woken;
+}
+
+/* Overview:
+ *  Wake every env sleeping anywhere in the page at pa. Called when the
+ *  page loses a mapping, since sleepers on shared pages (pipes) decide
+ *  that the other side is gone by looking at page reference counts.
+ */
+void
+env_wake_page(u_int pa)
+{
+	struct Env *e, *next;
+
+	for (e = LIST_FIRST(WAITQ(pa)); e; e = next) {
+		next = LIST_NEXT(e, env_wait_link);
+		if (PPN(e->env_wait_pa) != PPN(pa))
+			continue;
+		LIST_REMOVE(e, env_wait_link);
+		e->env_wait_pa = 0;
+		e->env_status = ENV_RUNNABLE;
+	}
 }
 
 /* Overview:
@@ -4,6 +4,7 @@
 #include <printf.h>
 #include <pmap.h>
 #include <sched.h>
+#include <fs.h>
 
 extern char *KERNEL_SP;
 extern struct Env *curenv;
@@ -20,6 +21,34 @@ void sys_putchar(int sysno, int c, int a2, int a3, int a4, int a5)
 	return ;
 }
 
+/* Overview:
+ * 	Print the `len` bytes at `buf` in curenv on screen, a whole string in
+ * one trap instead of one per character. Like writef() with putchar,
+ * each '\n' goes out twice.
+ *
+ * Post-Condition:
+ * 	Return 0 on success, -E_INVAL if the buffer reaches UTOP.
+ */
+int sys_cputs(int sysno, const char *buf, u_int len)
+{
+	u_int va;
+
+	if((u_int)buf >= UTOP || UTOP - (u_int)buf < len)
+		return -E_INVAL;
+	// Touch every page first: one paged in restarts the call (see
+	// lazy_fault()), which must not have printed anything yet.
+	for(va = ROUNDDOWN((u_int)buf, BY2PG); va < (u_int)buf + len; va += BY2PG)
+		*(volatile char *)va;
+
+	for(; len > 0; len--, buf++)
+	{
+		printcharc(*buf);
+		if(*buf == '\n')
+			printcharc('\n');
+	}
+	return 0;
+}
+
 /* Overview:
  * 	This function enables you to copy content of `srcaddr` to `destaddr`.
  *
@@ -215,6 +244,9 @@ int sys_mem_map(int sysno, u_int srcid, u_int srcva, u_int dstid, u_int dstva,
 	//printf("begin pgdir_walk in srcenv\n");
 	if((ret = pgdir_walk(srcenv->env_pgdir, round_srcva, 0, &ppte)) < 0)
 		return ret;
+	// nothing mapped at srcva, e.g. a bad address from an fs client
+	if(ppte == NULL || !(*ppte & PTE_V))
+		return -E_INVAL;
 	ppage = pa2page(PTE_ADDR(*ppte));
 	if((ret = page_insert(dstenv->env_pgdir, ppage, round_dstva, perm)) < 0)
 		return ret;
@@ -281,6 +313,7 @@ int sys_env_alloc(void)
 	e->env_tf.regs[2] = 0;
 	e->env_pgfault_handler = curenv->env_pgfault_handler; 
 	e->env_xstacktop = curenv->env_xstacktop;
+	bcopy(curenv->env_lazyseg, e->env_lazyseg, sizeof(e->env_lazyseg));
 	e->env_tf.pc = e->env_tf.cp0_epc;
 	pgdir_walk(curenv->env_pgdir, USTACKTOP - BY2PG, 0, &ppte);
 
@@ -376,12 +409,457 @@ void sys_panic(int sysno, char *msg)
 	panic("%s", TRUP(msg));
 }
 
+/* Overview:
+ * 	Register the lazily-paged region described by `seg` in envid's
+ * address space, replacing any region starting at the same va. envid must
+ * be curenv or one of its children.
+ *
+ * Pre-Condition:
+ * 	seg->ls_va and seg->ls_end are page-aligned and below UTOP, with
+ * ls_va <= ls_fileend <= ls_end. seg->ls_perm has PTE_V and not PTE_COW.
+ *
+ * Post-Condition:
+ * 	Return 0 on success, -E_NO_MEM if envid has no free region slot,
+ * -E_INVAL if seg is malformed, < 0 on other errors.
+ */
+int sys_lazy_map(int sysno, u_int envid, struct Lazyseg *useg)
+{
+	struct Env *e;
+	struct Lazyseg seg, *ls, *slot;
+	int i, r;
+
+	if((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if((u_int)useg >= UTOP || UTOP - (u_int)useg < sizeof(seg))
+		return -E_INVAL;
+	bcopy(useg, &seg, sizeof(seg));
+	if((seg.ls_va | seg.ls_end) & (BY2PG - 1)
+			|| seg.ls_va >= seg.ls_end || seg.ls_end > UTOP
+			|| seg.ls_fileend < seg.ls_va || seg.ls_fileend > seg.ls_end
+			|| !(seg.ls_perm & PTE_V) || (seg.ls_perm & PTE_COW))
+		return -E_INVAL;
+
+	slot = NULL;
+	for(i = 0; i < NLAZYSEG; i++)
+	{
+		ls = &e->env_lazyseg[i];
+		if(ls->ls_end && ls->ls_va == seg.ls_va)
+		{
+			slot = ls;
+			break;
+		}
+		if(!ls->ls_end && !slot)
+			slot = ls;
+	}
+	if(!slot)
+		return -E_NO_MEM;
+
+	bcopy(&seg, slot, sizeof(struct Lazyseg));
+	return 0;
+}
+
+/* Overview:
+ * 	Forget the lazily-paged region starting at `va` in envid's address
+ * space, envid being curenv or one of its children. Pages already brought
+ * in stay mapped.
+ *
+ * Post-Condition:
+ * 	Return 0 on success (also if there is no such region), < 0 on error.
+ */
+int sys_lazy_unmap(int sysno, u_int envid, u_int va)
+{
+	struct Env *e;
+	int i, r;
+
+	if((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	for(i = 0; i < NLAZYSEG; i++)
+		if(e->env_lazyseg[i].ls_end && e->env_lazyseg[i].ls_va == va)
+			e->env_lazyseg[i].ls_end = 0;
+	return 0;
+}
+
+/* Overview:
+ * 	Find the lazily-paged region of `e` covering `va`. When regions
+ * overlap on a page (the end of text and the start of data usually do),
+ * the writable one wins so the page gets a private copy.
+ */
+static struct Lazyseg *lazyseg_lookup(struct Env *e, u_int va)
+{
+	struct Lazyseg *ls, *found;
+	int i;
+
+	found = NULL;
+	for(i = 0; i < NLAZYSEG; i++)
+	{
+		ls = &e->env_lazyseg[i];
+		if(va < ls->ls_va || va >= ls->ls_end)
+			continue;
+		if(ls->ls_perm & PTE_R)
+			return ls;
+		found = ls;
+	}
+	return found;
+}
+
+static void ipc_deliver(struct Env *from, struct Env *to, u_int value,
+						struct Page *p, u_int perm);
+static int ipc_enqueue(struct Env *s, struct Env *e, u_int value,
+					   struct Page *p, u_int perm, int call);
+
+/* Overview:
+ * 	Called by pageout() on a TLB miss at `va` in curenv. If `va` lies in
+ * a lazily-paged region, bring the page in: bss pages are zero-filled on
+ * the spot, file pages are requested from the pager with a FSREQ_MAP
+ * sent in curenv's name, and curenv sleeps until the reply arrives (see
+ * lazy_fault_done()). It then re-executes the faulting instruction.
+ *
+ * 	A miss taken by a system call reading user memory is handled the
+ * same way, except that the whole system call is restarted once the page
+ * is in, so system calls must read user memory before they act. If no
+ * page is left for a bss page, such a system call fails with -E_NO_MEM;
+ * a user mode access cannot be told and destroys curenv.
+ *
+ * Post-Condition:
+ * 	Return 0 if the page was mapped, -E_NOT_FOUND if `va` is not lazy.
+ * Does not return while waiting for the pager.
+ */
+int lazy_fault(u_int va)
+{
+	struct Lazyseg *ls;
+	struct Env *pager;
+	struct Page *p;
+	struct Trapframe *tf;
+	struct Fsreq_map *req;
+	u_int pgva, exccode;
+
+	if(curenv == NULL || (ls = lazyseg_lookup(curenv, va)) == NULL)
+		return -E_NOT_FOUND;
+	pgva = ROUNDDOWN(va, BY2PG);
+
+	// The frame at KERNEL_SP is the one user mode entered the kernel
+	// with: the miss itself, or the system call that touched va.
+	tf = (struct Trapframe *)(KERNEL_SP - sizeof(struct Trapframe));
+	exccode = (tf->cp0_cause >> 2) & 0x1f;
+	if(exccode != 8 && ((exccode != 2 && exccode != 3) || tf->cp0_badvaddr != va))
+		panic("lazy page %x touched from kernel mode", va);
+
+	if(pgva >= ls->ls_fileend)
+	{
+		if(page_alloc(&p) == 0)
+			return page_insert(curenv->env_pgdir, p, pgva, ls->ls_perm);
+		if(exccode == 8)
+		{
+			tf->regs[2] = -E_NO_MEM;
+			sys_yield();
+		}
+		printf("[%08x] cannot page in %x: no memory\n", curenv->env_id, pgva);
+		env_destroy(curenv);
+	}
+
+	// run the system call again once the page is in
+	if(exccode == 8)
+		tf->cp0_epc -= 4;
+
+	if(envid2env(ls->ls_pager, &pager, 0) < 0)
+	{
+		printf("[%08x] pager %08x is gone\n", curenv->env_id, ls->ls_pager);
+		env_destroy(curenv);
+	}
+	req = (struct Fsreq_map *)curenv->env_send_msg;
+	req->req_fileid = ls->ls_fileid;
+	req->req_offset = ls->ls_offset + (pgva - ls->ls_va);
+	curenv->env_send_inline = 1;
+
+	// hand the request over now, or queue it like any other sender;
+	// nobody would answer an env that pages for itself
+	if(pager != curenv && pager->env_ipc_recving && !pager->env_ipc_partner)
+		ipc_deliver(curenv, pager, FSREQ_MAP, NULL, 0);
+	else if(ipc_enqueue(curenv, pager, FSREQ_MAP, NULL, 0, 0) < 0)
+	{
+		printf("[%08x] cannot page in %x: bad pager %08x\n",
+			   curenv->env_id, pgva, ls->ls_pager);
+		env_destroy(curenv);
+	}
+
+	curenv->env_lazy_va = pgva;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sys_yield();
+	return 0;
+}
+
+/* Overview:
+ * 	Complete the lazy fault `e` is sleeping on with the pager's reply
+ * (`value`, page at `srcva` in curenv). Read-only pages full of file data
+ * and every page of a PTE_LIBRARY region (an open file) share the pager's
+ * block; other writable and partially-filled ones get a private copy with
+ * the tail past ls_fileend left zero.
+ *
+ * Post-Condition:
+ * 	Return -E_IPC_NOT_RECV if curenv is not e's pager, 0 otherwise. If
+ * the pager failed, e is destroyed.
+ */
+static int lazy_fault_done(struct Env *e, int value, u_int srcva)
+{
+	struct Lazyseg *ls;
+	struct Page *p, *np;
+	Pte *pte;
+	u_int pgva, n;
+
+	pgva = e->env_lazy_va;
+	ls = lazyseg_lookup(e, pgva);
+	if(ls && ls->ls_pager != curenv->env_id)
+		return -E_IPC_NOT_RECV;
+	e->env_lazy_va = 0;
+
+	if(value < 0 || ls == NULL || srcva == 0
+			|| (p = page_lookup(curenv->env_pgdir, srcva, &pte)) == NULL)
+	{
+		printf("[%08x] cannot page in %x: %d\n", e->env_id, pgva, value);
+		env_destroy(e);
+		return 0;
+	}
+
+	n = ls->ls_fileend - pgva;
+	if(!(ls->ls_perm & PTE_LIBRARY) && ((ls->ls_perm & PTE_R) || n < BY2PG))
+	{
+		if(page_alloc(&np) < 0)
+		{
+			printf("[%08x] cannot page in %x: no memory\n", e->env_id, pgva);
+			env_destroy(e);
+			return 0;
+		}
+		bcopy((void *)page2kva(p), (void *)page2kva(np), MIN(n, BY2PG));
+		p = np;
+	}
+	page_insert(e->env_pgdir, p, pgva, ls->ls_perm);
+	e->env_status = ENV_RUNNABLE;
+	return 0;
+}
+
+/* Overview:
+ * 	Block curenv. The syscall it is in returns `ret` once it is made
+ * runnable again.
+ */
+static void ipc_block(int ret)
+{
+	struct Trapframe *tf;
+
+	tf = (struct Trapframe *)(KERNEL_SP - sizeof(struct Trapframe));
+	tf->regs[2] = ret;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sys_yield();
+}
+
+/* Overview:
+ * 	Mark `e` as receiving at its env_ipc_dstva. If `partner` is not 0,
+ * only that env may deliver to it (a closed receive, used to wait for the
+ * reply of ipc_call); other senders queue up.
+ */
+static void ipc_set_recving(struct Env *e, u_int partner)
+{
+	e->env_ipc_recving = 1;
+	e->env_ipc_partner = partner;
+	e->env_status = ENV_NOT_RUNNABLE;
+	env_wake(PADDR(&e->env_ipc_recving), NENV);
+}
+
+/* Overview:
+ * 	Hand a message from `from` to `to`, which must be receiving, and
+ * make `to` runnable. `p` (may be NULL) is mapped at to's env_ipc_dstva;
+ * from's staged inline payload, if any, is copied into to's env_ipc_msg.
+ */
+static void ipc_deliver(struct Env *from, struct Env *to, u_int value,
+						struct Page *p, u_int perm)
+{
+	to->env_ipc_recving = 0;
+	to->env_ipc_partner = 0;
+	to->env_ipc_from = from->env_id;
+	to->env_ipc_value = value;
+	to->env_ipc_perm = 0;
+	if(from->env_send_inline)
+		bcopy(from->env_send_msg, to->env_ipc_msg, sizeof(to->env_ipc_msg));
+	if(p && to->env_ipc_dstva < UTOP
+			&& page_insert(to->env_pgdir, p, to->env_ipc_dstva, perm) == 0)
+		to->env_ipc_perm = perm;
+	to->env_status = ENV_RUNNABLE;
+}
+
+/* Overview:
+ * 	Stage the IPC_MSGWORDS words at user address `msg` of curenv as the
+ * inline payload of its next message (no payload if `msg` is 0). Callers
+ * stage before they send, so a page of the buffer brought in by
+ * lazy_fault() just restarts the system call.
+ *
+ * Post-Condition:
+ * 	Return 0 on success, -E_INVAL if the buffer reaches UTOP.
+ */
+static int ipc_stage(u_int msg)
+{
+	curenv->env_send_inline = 0;
+	if(msg == 0)
+		return 0;
+	if(msg >= UTOP || UTOP - msg < sizeof(curenv->env_send_msg))
+		return -E_INVAL;
+	bcopy((void *)msg, curenv->env_send_msg, sizeof(curenv->env_send_msg));
+	curenv->env_send_inline = 1;
+	return 0;
+}
+
+/* Overview:
+ * 	Send from curenv to `e` if it can take the message right now: a
+ * reply to its lazy fault, or e is receiving from us.
+ *
+ * Post-Condition:
+ * 	Return 0 on delivery, -E_IPC_NOT_RECV if e is not ready, < 0 on
+ * other errors.
+ */
+static int ipc_try_send(struct Env *e, u_int value, u_int srcva, u_int perm)
+{
+	struct Page *p;
+	int r;
+
+	if(e->env_lazy_va && (r = lazy_fault_done(e, value, srcva)) != -E_IPC_NOT_RECV)
+		return r;
+	if(!e->env_ipc_recving
+			|| (e->env_ipc_partner && e->env_ipc_partner != curenv->env_id))
+		return -E_IPC_NOT_RECV;
+
+	p = NULL;
+	if(srcva && (srcva >= UTOP || (p = page_lookup(curenv->env_pgdir, srcva, 0)) == NULL))
+		return -E_INVAL;
+	ipc_deliver(curenv, e, value, p, perm);
+	return 0;
+}
+
+/* Overview:
+ * 	Queue `s` on the senders of `e`. The page is looked up now and held
+ * until delivery, so it may not be NULL if `srcva` is not 0. `call` says
+ * s waits for a reply once its message is taken.
+ */
+static int ipc_enqueue(struct Env *s, struct Env *e, u_int value,
+					   struct Page *p, u_int perm, int call)
+{
+	if(s == e)
+		return -E_INVAL;
+	if(p)
+		p->pp_ref++;
+	s->env_send_to = e->env_id;
+	s->env_send_value = value;
+	s->env_send_page = p;
+	s->env_send_perm = perm;
+	s->env_send_call = call;
+	TAILQ_INSERT_TAIL(&e->env_senders, s, env_send_link);
+	return 0;
+}
+
+/* Overview:
+ * 	Let `e`, about to receive, take the message of the first env queued
+ * on it. That sender is made runnable, or starts waiting for the reply if
+ * it was an ipc_call; lazy faulters keep waiting for the pager's answer.
+ *
+ * Post-Condition:
+ * 	Return 0 if a message was taken, -E_IPC_NOT_RECV if nobody waits.
+ */
+static int ipc_take_sender(struct Env *e)
+{
+	struct Env *s;
+
+	if((s = e->env_senders.tqh_first) == NULL)
+		return -E_IPC_NOT_RECV;
+	TAILQ_REMOVE(&e->env_senders, s, env_send_link);
+	s->env_send_to = 0;
+
+	ipc_deliver(s, e, s->env_send_value, s->env_send_page, s->env_send_perm);
+	if(s->env_send_page)
+	{
+		page_decref(s->env_send_page);
+		s->env_send_page = NULL;
+	}
+
+	if(s->env_send_call)
+		ipc_set_recving(s, e->env_id);
+	else if(!s->env_lazy_va)
+		s->env_status = ENV_RUNNABLE;
+	return 0;
+}
+
+/* Overview:
+ * 	Tear down the IPC state of `e`, which is being freed (see env_free()):
+ * leave the queue it sits in, fail the senders queued on it and the
+ * callers waiting for its reply with -E_BAD_ENV (lazy faulters cannot be
+ * told, so they go down with their pager).
+ */
+void ipc_cancel(struct Env *e)
+{
+	struct Env *t, *s;
+	struct Lazyseg *ls;
+	int i;
+
+	if(e->env_send_to)
+	{
+		t = &envs[ENVX(e->env_send_to)];
+		TAILQ_REMOVE(&t->env_senders, e, env_send_link);
+		e->env_send_to = 0;
+		if(e->env_send_page)
+		{
+			page_decref(e->env_send_page);
+			e->env_send_page = NULL;
+		}
+	}
+
+	while((s = e->env_senders.tqh_first) != NULL)
+	{
+		TAILQ_REMOVE(&e->env_senders, s, env_send_link);
+		s->env_send_to = 0;
+		if(s->env_send_page)
+		{
+			page_decref(s->env_send_page);
+			s->env_send_page = NULL;
+		}
+		if(s->env_lazy_va)
+		{
+			printf("[%08x] pager %08x is gone\n", s->env_id, e->env_id);
+			env_destroy(s);
+			continue;
+		}
+		s->env_tf.regs[2] = -E_BAD_ENV;
+		s->env_status = ENV_RUNNABLE;
+	}
+
+	// requests e already took, whose callers wait for e's reply
+	for(i = 0; i < NENV; i++)
+	{
+		s = &envs[i];
+		if(s == e || s->env_status == ENV_FREE)
+			continue;
+		if(s->env_lazy_va && (ls = lazyseg_lookup(s, s->env_lazy_va)) != NULL
+				&& ls->ls_pager == e->env_id)
+		{
+			printf("[%08x] pager %08x is gone\n", s->env_id, e->env_id);
+			env_destroy(s);
+			continue;
+		}
+		if(s->env_ipc_recving && s->env_ipc_partner == e->env_id)
+		{
+			s->env_ipc_recving = 0;
+			s->env_ipc_partner = 0;
+			s->env_tf.regs[2] = -E_BAD_ENV;
+			s->env_status = ENV_RUNNABLE;
+		}
+	}
+}
+
 /* Overview:
  * 	This function enables caller to receive message from 
  * other process. To be more specific, it will flag 
  * the current process so that other process could send 
  * message to it.
  *
+ * 	If senders are queued on us, the first one's message is taken
+ * right away without giving up the cpu.
+ *
  * Pre-Condition:
  * 	`dstva` is valid (Note: NULL is also a valid value for `dstva`).
  * 
@@ -393,9 +871,10 @@ void sys_ipc_recv(int sysno, u_int dstva)
 {
 	struct Env *env;
 	envid2env(0, &env, 0);
-	env->env_status = ENV_NOT_RUNNABLE;
-	env->env_ipc_recving = 1;
 	env->env_ipc_dstva = dstva;
+	if(ipc_take_sender(env) == 0)
+		return;
+	ipc_set_recving(env, 0);
 	//printf("sys_ipc_recv(dstva:0x%x)\n", dstva);
 	sys_yield();
 }
@@ -414,42 +893,181 @@ void sys_ipc_recv(int sysno, u_int dstva)
  *
  * Post-Condition:
  * 	Return 0 on success, < 0 on error.
- *
- * Hint: the only function you need to call is envid2env.
  */
+int sys_ipc_can_send(int sysno, u_int envid, u_int value, u_int srcva,
+					 u_int perm, u_int msg)
+{
+	int r;
+	struct Env *e;
+
+	//printf("%x send:to:%x,v:%d,srcva:%d\n", curenv->env_id, envid, value, srcva);
+	if((r = envid2env(envid, &e, 0)) < 0)
+		return r;
+	if((r = ipc_stage(msg)) < 0)
+		return r;
+	return ipc_try_send(e, value, srcva, perm);
+}
 
-/*
- * May be supposed to map srcva to dstva? And set e->env_ipc_perm?
- * possilbe pre-Condition: srcva and dstva are 4K aligned.
+/* Overview:
+ * 	Send 'value' (and the page at 'srcva' and the IPC_MSGWORDS words at
+ * 'msg', each if not 0) to 'envid', blocking until it is delivered. While the target is not receiving, the
+ * caller waits in the target's queue of senders, which sys_ipc_recv
+ * serves in order.
+ *
+ * Post-Condition:
+ * 	Return 0 once delivered, -E_BAD_ENV if the target went away first,
+ * < 0 on other errors.
  */
-int sys_ipc_can_send(int sysno, u_int envid, u_int value, u_int srcva,
-					 u_int perm)
+int sys_ipc_send(int sysno, u_int envid, u_int value, u_int srcva, u_int perm,
+				 u_int msg)
 {
+	int r;
+	struct Env *e;
+	struct Page *p;
 
+	if((r = envid2env(envid, &e, 0)) < 0)
+		return r;
+	if((r = ipc_stage(msg)) < 0)
+		return r;
+	if((r = ipc_try_send(e, value, srcva, perm)) != -E_IPC_NOT_RECV)
+		return r;
+
+	p = NULL;
+	if(srcva && (srcva >= UTOP || (p = page_lookup(curenv->env_pgdir, srcva, 0)) == NULL))
+		return -E_INVAL;
+	if((r = ipc_enqueue(curenv, e, value, p, perm, 0)) < 0)
+		return r;
+	ipc_block(0);
+	return 0;
+}
+
+/* Overview:
+ * 	Send a request to 'envid' and wait for its reply in one step: once
+ * the request is taken, the caller receives at 'dstva', from 'envid'
+ * only. The reply is read from env_ipc_value/_from/_perm as after
+ * sys_ipc_recv.
+ *
+ * Post-Condition:
+ * 	Return 0 once the reply arrived, < 0 if the request could not be
+ * sent.
+ */
+int sys_ipc_call(int sysno, u_int envid, u_int value, u_int srcva, u_int perm,
+				 u_int dstva, u_int msg)
+{
 	int r;
 	struct Env *e;
 	struct Page *p;
 
-	//printf("%x send:to:%x,v:%d,srcva:%d\n", curenv->env_id, envid, value, srcva);
-	//CHECK: permcheck
 	if((r = envid2env(envid, &e, 0)) < 0)
 		return r;
+	if((r = ipc_stage(msg)) < 0)
+		return r;
+	curenv->env_ipc_dstva = dstva;
 
-	if(!e->env_ipc_recving)
-		return -E_IPC_NOT_RECV;
+	r = ipc_try_send(e, value, srcva, perm);
+	if(r == 0)
+		ipc_set_recving(curenv, e->env_id);
+	else if(r == -E_IPC_NOT_RECV)
+	{
+		p = NULL;
+		if(srcva && (srcva >= UTOP || (p = page_lookup(curenv->env_pgdir, srcva, 0)) == NULL))
+			return -E_INVAL;
+		if((r = ipc_enqueue(curenv, e, value, p, perm, 1)) < 0)
+			return r;
+	}
+	else
+		return r;
+	ipc_block(0);
+	return 0;
+}
 
-	e->env_ipc_recving = 0;
-	//CHECK: direct invokation of curenv?
-	//printf("from 0x%x\n", curenv->env_id);
-	e->env_ipc_from = curenv->env_id;
-	e->env_ipc_value = value;
-	e->env_ipc_perm = perm;
+/* Overview:
+ * 	Server side of sys_ipc_call: reply to 'envid' (skipped if 0) without
+ * waiting, then receive the next request at 'dstva' as sys_ipc_recv does.
+ *
+ * Post-Condition:
+ * 	Return the result of the reply (-E_IPC_NOT_RECV if the client was
+ * not waiting for it); the next request has been received in any case.
+ */
+int sys_ipc_reply_wait(int sysno, u_int envid, u_int value, u_int srcva,
+					   u_int perm, u_int dstva, u_int msg)
+{
+	int r;
+	struct Env *e;
 
-	if(srcva)
-		sys_mem_map(sysno, 0, srcva, envid, e->env_ipc_dstva, perm);
+	r = 0;
+	if(envid && (r = envid2env(envid, &e, 0)) == 0
+			&& (r = ipc_stage(msg)) == 0)
+		r = ipc_try_send(e, value, srcva, perm);
 
-	e->env_status = ENV_RUNNABLE;
+	curenv->env_ipc_dstva = dstva;
+	if(ipc_take_sender(curenv) == 0)
+		return r;
+	ipc_set_recving(curenv, 0);
+	ipc_block(r);
+	return r;
+}
+
+/* Overview:
+ * 	Translate the word-aligned user address `va` of curenv into the
+ * physical address wait queues are keyed by, so that envs sharing a page
+ * at different addresses meet in the same queue.
+ *
+ * Post-Condition:
+ * 	Return 0 and set *ppa on success, -E_INVAL if va is not mapped.
+ */
+static int wait_key(u_int va, u_int *ppa)
+{
+	struct Page *p;
+
+	if((va & 3) || va >= ULIM)
+		return -E_INVAL;
+	if((p = page_lookup(curenv->env_pgdir, va, 0)) == NULL)
+		return -E_INVAL;
+	*ppa = page2pa(p) + (va & (BY2PG - 1));
+	return 0;
+}
+
+/* Overview:
+ * 	Sleep until sys_wake(va, ...) if the word at `va` still holds
+ * `expected`. The check and the sleep cannot be separated by a wake,
+ * since nothing else runs in between.
+ *
+ * Post-Condition:
+ * 	Return 0 once woken, or right away if *va != expected.
+ * 	Return -E_INVAL if va is not a mapped, word-aligned address.
+ * 	Wakeups may be spurious: callers re-check their condition.
+ */
+int sys_wait_on(int sysno, u_int va, u_int expected)
+{
+	struct Trapframe *tf;
+	u_int pa;
+	int r;
 
+	if((r = wait_key(va, &pa)) < 0)
+		return r;
+	if(*(u_int *)KADDR(pa) != expected)
+		return 0;
+
+	tf = (struct Trapframe *)(KERNEL_SP - sizeof(struct Trapframe));
+	tf->regs[2] = 0;
+	env_wait(curenv, pa);
+	sys_yield();
 	return 0;
 }
 
+/* Overview:
+ * 	Wake at most `n` envs sleeping in sys_wait_on on the word at `va`.
+ *
+ * Post-Condition:
+ * 	Return the number of envs woken, < 0 on error.
+ */
+int sys_wake(int sysno, u_int va, int n)
+{
+	u_int pa;
+	int r;
+
+	if((r = wait_key(va, &pa)) < 0)
+		return r;
+	return env_wake(pa, n);
+}
@@ -1,5 +1,6 @@
 #include <trap.h>
 #include <env.h>
+#include <pmap.h>
 #include <printf.h>
 
 extern void handle_int();
@@ -46,8 +47,20 @@ page_fault_handler(struct Trapframe *tf)
         u_int va;
         u_int *tos, d;
 	struct Trapframe PgTrapFrame;
+	Pte *pte;
 	extern struct Env * curenv;
 //printf("^^^^cp0_BadVAddress:%x\n",tf->cp0_badvaddr);
+
+	// First write to a dirty-tracked page: record it in PTE_D, let the
+	// TLB take the page writable and retry the store.
+	va = tf->cp0_badvaddr;
+	pgdir_walk(curenv->env_pgdir, va, 0, &pte);
+	if(pte && (*pte & PTE_V) && (*pte & PTE_DTRACK))
+	{
+		*pte |= PTE_R | PTE_D;
+		tlb_invalidate(curenv->env_pgdir, va);
+		return;
+	}
 
 	
 	bcopy(tf, &PgTrapFrame,sizeof(struct Trapframe));
@@ -439,6 +439,7 @@ page_remove(Pde *pgdir, u_long va)
     /* Step 2: Decrease `pp_ref` and decide if it's necessary to free this page. */
 
     /* Hint: When there's no virtual address mapped to this page, release it. */
+    env_wake_page(page2pa(ppage));
     ppage->pp_ref--;
     if (ppage->pp_ref == 0) {
         page_free(ppage);
@@ -605,6 +606,10 @@ void pageout(int va, int context)
         panic("^^^^^^TOO LOW^^^^^^^^^");
     }
 
+    if (lazy_fault(va) == 0) {
+        return;
+    }
+
     if ((r = page_alloc(&p)) < 0) {
         panic ("page alloc error!");
     }
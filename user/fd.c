@@ -10,23 +10,6 @@
 
 #define debug 0
 
-/** Maximum number of file descriptor.
- */
-#define MAXFD 32
-/** Base address of the data regions of files opend by a process.
- */
-#define FILEBASE 0x60000000
-/** Base address of file descriptor table owned by a process.
- */
-#define FDTABLE (FILEBASE-PDMAP)
-
-/** Convert index of a Fd to its address.
- */
-#define INDEX2FD(i)	(FDTABLE+(i)*BY2PG)
-/** Convert index of a Fd to its data region's address.
- */
-#define INDEX2DATA(i)	(FILEBASE+(i)*PDMAP)
-
 /** Array of device descriptors.
  */
 static struct Dev *devtab[] =
@@ -223,6 +206,48 @@ close_all(void)
 		close(i);
 }
 
+/** Share the file descriptor table and the data of every open file with a
+ * child process.
+ *
+ * These are the only PTE_LIBRARY pages of a user process, so only the
+ * #MAXFD fd pages and the first fd_npage pages of each data region are
+ * looked at, instead of the whole address space.
+ *
+ * Return `0` on success, otherwise an error code.
+ *
+ * @param[in] envid Id of the child process.
+ */
+int
+fd_share(u_int envid)
+{
+	int i, r;
+	u_int j, va, pte;
+	struct Fd *fd;
+
+	if (!((* vpd)[PDX(FDTABLE)]&PTE_V))
+		return 0;
+	for (i=0; i<MAXFD; i++) {
+		fd = (struct Fd*)INDEX2FD(i);
+		pte = (* vpt)[VPN(fd)];
+		if (!(pte&PTE_V) || !(pte&PTE_LIBRARY))
+			continue;
+		if ((r = syscall_mem_map(0, (u_int)fd, envid, (u_int)fd, pte&PTE_SHARE)) < 0)
+			return r;
+
+		va = INDEX2DATA(i);
+		for (j=0; j<fd->fd_npage && j<FDDATASIZE/BY2PG; j++) {
+			if (!((* vpd)[PDX(va+j*BY2PG)]&PTE_V))
+				continue;
+			pte = (* vpt)[VPN(va+j*BY2PG)];
+			if (!(pte&PTE_V) || !(pte&PTE_LIBRARY))
+				continue;
+			if ((r = syscall_mem_map(0, va+j*BY2PG, envid, va+j*BY2PG, pte&PTE_SHARE)) < 0)
+				return r;
+		}
+	}
+	return 0;
+}
+
 /** Duplicate a Fd specified by its index.
  *
  * The function first close the file represented by newfdnum, and then map
@@ -246,6 +271,7 @@ dup(int oldfdnum, int newfdnum)
 	int i, r;
 	u_int ova, nva, pte;
 	struct Fd *oldfd, *newfd;
+	struct Lazyseg ls;
 	//writef("dup comes 1;\n");
 	if ((r = fd_lookup(oldfdnum, &oldfd)) < 0)
 		return r;
@@ -256,25 +282,38 @@ dup(int oldfdnum, int newfdnum)
 	close(newfdnum);
 
 //writef("dup comes 2.5;\n");
-	if ((* vpd)[PDX(ova)]) {
-		for (i=0; i<PDMAP; i+=BY2PG) {
-			pte = (* vpt)[VPN(ova+i)];
-			if(pte&PTE_V) {
-				// should be no error here -- pd is already allocated
-				if ((r = syscall_mem_map(0, ova+i, 0, nva+i, pte&(PTE_V|PTE_R|PTE_LIBRARY))) < 0)
-					goto err;
-			}
+	// pages not touched yet are still to be faulted in at the new place
+	for (i=0; i<NLAZYSEG; i++) {
+		ls = env->env_lazyseg[i];
+		if (!ls.ls_end || ls.ls_va != ova)
+			continue;
+		ls.ls_va = nva;
+		ls.ls_end += nva - ova;
+		ls.ls_fileend += nva - ova;
+		if ((r = syscall_lazy_map(0, &ls)) < 0)
+			goto err;
+		break;
+	}
+	for (i=0; i<oldfd->fd_npage*BY2PG && i<FDDATASIZE; i+=BY2PG) {
+		if (!((* vpd)[PDX(ova+i)]&PTE_V))
+			continue;
+		pte = (* vpt)[VPN(ova+i)];
+		if(pte&PTE_V) {
+			// should be no error here -- pd is already allocated
+			if ((r = syscall_mem_map(0, ova+i, 0, nva+i, pte&PTE_SHARE)) < 0)
+				goto err;
 		}
 	}
-	if ((r = syscall_mem_map(0, (u_int)oldfd, 0, (u_int)newfd, ((*vpt)[VPN(oldfd)])&(PTE_V|PTE_R|PTE_LIBRARY))) < 0)
+	if ((r = syscall_mem_map(0, (u_int)oldfd, 0, (u_int)newfd, ((*vpt)[VPN(oldfd)])&PTE_SHARE)) < 0)
 		goto err;
 //writef("dup comes 3;\n");
 	return newfdnum;
 
 err:
 //writef("dup comes 4;\n");
+	syscall_lazy_unmap(0, nva);
 	syscall_mem_unmap(0, (u_int)newfd);
-	for (i=0; i<PDMAP; i+=BY2PG)
+	for (i=0; i<FDDATASIZE; i+=BY2PG)
 		syscall_mem_unmap(0, nva+i);
 	return r;
 }
@@ -348,6 +387,66 @@ readn(int fdnum, void *buf, u_int n)
 	return tot;
 }
 
+/** Copy n bytes of one file, from offset on, to another.
+ *
+ * If the input device can point at its data in memory (a file, which is
+ * mapped at its fd's data region), the bytes go from there straight to the
+ * output device's dev_write, so a file reaches a pipe or the console with
+ * a single copy. Otherwise they pass through a small buffer.
+ *
+ * The offset of infd is neither used nor moved; that of outfd advances.
+ *
+ * Return the number of bytes copied, which is less than n at the end of
+ * the input, or an error code if none were.
+ *
+ * @param[in] outfdnum Index of the file to write to.
+ * @param[in] infdnum Index of the file to read from.
+ * @param[in] offset Offset in the input to start at.
+ * @param[in] n Maximum number of bytes to copy.
+ */
+int
+sendfile(int outfdnum, int infdnum, u_int offset, u_int n)
+{
+	char buf[512];
+	int r, m, tot, w;
+	void *va;
+	struct Dev *indev, *outdev;
+	struct Fd *in, *out;
+
+	if ((r = fd_lookup(infdnum, &in)) < 0
+	||  (r = dev_lookup(in->fd_dev_id, &indev)) < 0
+	||  (r = fd_lookup(outfdnum, &out)) < 0
+	||  (r = dev_lookup(out->fd_dev_id, &outdev)) < 0)
+		return r;
+	if ((in->fd_omode & O_ACCMODE) == O_WRONLY
+	||  (out->fd_omode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+
+	// straight from where the input sits in memory
+	if (indev->dev_map && (*indev->dev_map)(in, offset, &va, &n) == 0) {
+		for (tot = 0; tot < n; tot += r) {
+			r = (*outdev->dev_write)(out, (char*)va + tot, n - tot, out->fd_offset);
+			if (r <= 0)
+				return tot ? tot : r;
+			out->fd_offset += r;
+		}
+		return tot;
+	}
+
+	for (tot = 0; tot < n; tot += m) {
+		m = (*indev->dev_read)(in, buf, MIN(n - tot, sizeof buf), offset + tot);
+		if (m <= 0)
+			return tot ? tot : m;
+		for (w = 0; w < m; w += r) {
+			r = (*outdev->dev_write)(out, buf + w, m - w, out->fd_offset);
+			if (r <= 0)
+				return tot + w ? tot + w : r;
+			out->fd_offset += r;
+		}
+	}
+	return tot;
+}
+
 /** Write n bytes to a file specified by its descriptor's index.
  *
  * Call a device dependent function, actually an interface, to wrtie n bytes
@@ -8,6 +8,42 @@
 #include <types.h>
 #include <fs.h>
 
+/** Maximum number of file descriptor.
+ */
+#define MAXFD 32
+/** Base address of the data regions of files opend by a process.
+ */
+#define FILEBASE 0x60000000
+/** Base address of file descriptor table owned by a process.
+ */
+#define FDTABLE (FILEBASE-PDMAP)
+
+/** Convert index of a Fd to its address.
+ */
+#define INDEX2FD(i)	(FDTABLE+(i)*BY2PG)
+/** Bytes of the data region of a Fd, large enough for a whole file.
+ */
+#define FDDATASIZE	MAXFILESIZE
+/** Convert index of a Fd to its data region's address.
+ */
+#define INDEX2DATA(i)	(FILEBASE+(i)*FDDATASIZE)
+
+/** Maximum number of mmap() regions of a process at once.
+ */
+#define NMMAP		16
+/** Base address of the mmap() regions, #FDDATASIZE bytes apart.
+ */
+#define MMAPBASE	0x50000000
+/** Page holding a second mapping of the Filefd of mmap() region i, which
+ * keeps the file open on the server until munmap().
+ */
+#define MMAPFD(i)	(MMAPBASE-(NMMAP-(i))*BY2PG)
+/** Permission bits kept when a fd or data page is shared with another
+ * mapping. #PTE_D goes along with #PTE_R, so a page the kernel made
+ * writable on its first write is still reported dirty from the new place.
+ */
+#define PTE_SHARE	(PTE_V|PTE_R|PTE_D|PTE_DTRACK|PTE_LIBRARY)
+
 // pre-declare for forward references
 struct Fd;
 struct Stat;
@@ -22,6 +58,10 @@ struct Dev
 	int (*dev_close)(struct Fd*);
 	int (*dev_stat)(struct Fd*, struct Stat*);
 	int (*dev_seek)(struct Fd*, u_int);
+	/** Point at the data from an offset on where it already sits in
+	 * memory, see sendfile(). `0` for devices that cannot.
+	 */
+	int (*dev_map)(struct Fd*, u_int, void**, u_int*);
 };
 
 /** File descriptor.
@@ -41,6 +81,11 @@ struct Fd
 	/** %Open mode indicating which operation can be done on the file.
 	 */
 	u_int fd_omode;
+	/** Number of pages at the start of the data region that may be mapped.
+	 *
+	 * Bounds the walk of fd_share() and dup() over the data region.
+	 */
+	u_int fd_npage;
 };
 
 struct Stat
@@ -65,6 +110,7 @@ int fd_lookup(int fdnum, struct Fd **fd);
 u_int fd2data(struct Fd*);
 int fd2num(struct Fd*);
 int dev_lookup(int dev_id, struct Dev **dev);
+int fd_share(u_int envid);
 int
 num2fd(int fd);
 extern struct Dev devcons;
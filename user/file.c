@@ -11,6 +11,8 @@ static int file_close(struct Fd *fd);
 static int file_read(struct Fd *fd, void *buf, u_int n, u_int offset);
 static int file_write(struct Fd *fd, const void *buf, u_int n, u_int offset);
 static int file_stat(struct Fd *fd, struct Stat *stat);
+static int file_lazy_map(struct Fd *fd, u_int size);
+static int file_map(struct Fd *fd, u_int offset, void **va, u_int *n);
 
 struct Dev devfile =
 {
@@ -20,6 +22,7 @@ struct Dev devfile =
 .dev_write=	file_write,
 .dev_close=	file_close,
 .dev_stat=	file_stat,
+.dev_map=	file_map,
 };
 
 
@@ -31,10 +34,8 @@ open(const char *path, int mode)
 	// Your code here.
 	struct Fd *fd;
 	struct Filefd *ffd;
-	u_int size,fileid;
+	u_int size;
 	int r;
-	u_int va;
-	u_int i;
 	
 //writef("enter open\n");
 	//alloc a fd	
@@ -59,23 +60,19 @@ writef("open:come 2\n");
 		writef("cannont open file %s\n",path);
 		return r;
 	}
-	va = fd2data(fd);	//the start address storing the file's content
 	ffd = (struct Filefd*)fd;
 	size = ffd->f_file.f_size;
-	fileid = ffd->f_fileid;
 //writef("open:ffd = %x,	size = %x,	fileid=%d,	va =%x\n",(u_int)ffd, size, fileid,va);	
 	
 	//map the file content into memory
+	fd->fd_npage = ROUND(size, BY2PG)/BY2PG;
 	if(size == 0) return fd2num(fd);
 	
-	for( i = 0; i < size; i+=BY2PG)
+	// pages are brought in by the kernel on first touch
+	if((r = file_lazy_map(fd, size))<0)
 	{
-		if((r = fsipc_map(fileid, i, va+i))<0)
-		{
-			writef("cannot map the file.\n");
-			return r;
-		}
-//writef("i=%x,	(* vpd)[PDX(%x)]&PTE_P=%x,	(* vpt)[VPN(%x)]&PTE_P=%x\n",i,va+i,(* vpd)[PDX(va+i)]&PTE_V,va+i,(* vpt)[VPN(va+i)]&PTE_V);
+		writef("cannot map the file.\n");
+		return r;
 	}
 //writef("open:ffd = %x\n",(u_int)ffd);
 	return fd2num(fd);
@@ -97,13 +94,14 @@ file_close(struct Fd *fd)
 	size = ffd->f_file.f_size;
 	va = fd2data(fd);       //the start address storing the file's content
 
-	//tell the file server the dirty page.
+	//tell the file server the pages we wrote, a ring batch at a time.
+	//the kernel set PTE_D on the first write to each of them.
 	for(i = 0; i < size; i += BY2PG)
 	{
-		//our framework can't PTE_D
-		//if(((* vpt)[(va+i)/BY2PG] & PTE_D)!=0)
-			fsipc_dirty(fileid, i);
+		if(((* vpd)[PDX(va+i)] & PTE_V) && ((* vpt)[VPN(va+i)] & PTE_D))
+			fsring_post(FSREQ_DIRTY, fileid, i, 0, i, 0);
 	}
+	fsring_flush();
 	
 	//request the file server to close the file
 	if((r = fsipc_close(fileid))<0)
@@ -113,10 +111,13 @@ file_close(struct Fd *fd)
 	}
 	
 	//unmap the content of file
+	syscall_lazy_unmap(0, va);
 	if(size == 0) return 0;
 	
 	for(i = 0; i < size; i +=BY2PG)
 	{
+		if(!((* vpd)[PDX(va+i)] & PTE_V) || !((* vpt)[VPN(va+i)] & PTE_V))
+			continue;
 		if((r = syscall_mem_unmap(0, va+i))<0)
 		{
 			writef("cannont unmap the file.\n");
@@ -173,6 +174,9 @@ read_map(int fdnum, u_int offset, void **blk)
 	va = fd2data(fd) + offset;
 	if (offset >= MAXFILESIZE)
 		return -E_NO_DISK;
+	// touch the page so that a lazily-mapped file brings it in
+	if (offset < ((struct Filefd*)fd)->f_file.f_size)
+		*(volatile char*)va;
 //writef("offset=%x,      va=%x,  (* vpd)[PDX(va)]&PTE_P=%x,  (* vpt)[VPN(va)]&PTE_P=%x\n",offset,va,(* vpd)[PDX(va)]&PTE_V,(* vpt)[VPN(va)]&PTE_V);
 	if (!((* vpd)[PDX(va)]&PTE_V) || !((* vpt)[VPN(va)]&PTE_V))
 	{
@@ -194,7 +198,7 @@ file_write(struct Fd *fd, const void *buf, u_int n, u_int offset)
 
 	// don't write past the maximum file size
 	tot = offset + n;
-	if (tot > MAXFILESIZE)
+	if (tot < offset || tot > MAXFILESIZE)
 		return -E_NO_DISK;
 
 	// increase the file's size if necessary
@@ -221,6 +225,21 @@ file_stat(struct Fd *fd, struct Stat *st)
 	return 0;
 }
 
+// Set *va to the file data at 'offset' in the pages the file is mapped at,
+// and trim *n to the bytes the file has from there on.
+static int
+file_map(struct Fd *fd, u_int offset, void **va, u_int *n)
+{
+	u_int size;
+
+	size = ((struct Filefd*)fd)->f_file.f_size;
+	if (offset > size)
+		return -E_INVAL;
+	*n = MIN(*n, size - offset);
+	*va = (void*)(fd2data(fd) + offset);
+	return 0;
+}
+
 // Truncate or extend an open file to 'size' bytes
 int
 ftruncate(int fdnum, u_int size)
@@ -245,17 +264,18 @@ ftruncate(int fdnum, u_int size)
 		return r;
 
 	va = fd2data(fd);
-	// Map any new pages needed if extending the file
-	for (i = ROUND(oldsize, BY2PG); i < ROUND(size, BY2PG); i += BY2PG) {
-		if ((r = fsipc_map(fileid, i, va+i)) < 0) {
-			fsipc_set_size(fileid, oldsize);
-			return r;
-		}
+	// Cover the new size with the lazily-mapped region
+	if ((r = file_lazy_map(fd, size)) < 0) {
+		fsipc_set_size(fileid, oldsize);
+		return r;
 	}
+	if (fd->fd_npage < ROUND(size, BY2PG)/BY2PG)
+		fd->fd_npage = ROUND(size, BY2PG)/BY2PG;
 
 	// Unmap pages if truncating the file
 	for (i = ROUND(size, BY2PG); i < ROUND(oldsize, BY2PG); i+=BY2PG)
-		if ((r = syscall_mem_unmap(0, va+i)) < 0)
+		if (((* vpd)[PDX(va+i)] & PTE_V) && ((* vpt)[VPN(va+i)] & PTE_V)
+		&&  (r = syscall_mem_unmap(0, va+i)) < 0)
 			user_panic("ftruncate: syscall_mem_unmap %08x: %e", va+i, r);
 	return 0;
 }
@@ -274,3 +294,133 @@ sync(void)
 	return fsipc_sync();
 }
 
+// Regions handed out by mmap(), slot i at MMAPBASE + i*FDDATASIZE.
+static struct {
+	u_int m_len;		// bytes mapped, 0 if the slot is free
+	u_int m_fileid;		// file server id of the file
+	u_int m_offset;		// file offset of the first byte
+	u_int m_ndata;		// bytes of file data in it, the rest is zero fill
+} mmaptab[NMMAP];
+
+// Map len bytes of the file open on fdnum, from the page-aligned offset,
+// and set *addr to them. The pages are brought in on first touch and are
+// the file server's own cached blocks, so no data is copied. With
+// PROT_WRITE (allowed only if fdnum is open for writing) stores go to
+// the file; munmap() hands them to the file server.
+int
+mmap(int fdnum, u_int offset, u_int len, int prot, void **addr)
+{
+	struct Fd *fd;
+	struct Filefd *f;
+	struct Lazyseg ls;
+	u_int va, size;
+	int i, r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	f = (struct Filefd*)fd;
+	size = f->f_file.f_size;
+	if ((offset & (BY2PG-1)) || len == 0 || len > FDDATASIZE
+	||  offset >= size || (prot & ~(PROT_READ|PROT_WRITE)))
+		return -E_INVAL;
+	if ((prot & PROT_WRITE) && (fd->fd_omode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+
+	for (i = 0; i < NMMAP && mmaptab[i].m_len; i++)
+		;
+	if (i == NMMAP)
+		return -E_NO_MEM;
+	va = MMAPBASE + i*FDDATASIZE;
+
+	// hold the open file as spawn() holds its exec fd, so that a
+	// close(fdnum) cannot let the server reuse the fileid
+	if ((r = syscall_mem_map(0, (u_int)fd, 0, MMAPFD(i),
+			PTE_V|PTE_R|PTE_LIBRARY)) < 0)
+		return r;
+	ls.ls_va = va;
+	ls.ls_end = va + ROUND(len, BY2PG);
+	ls.ls_fileend = va + MIN(len, size - offset);
+	ls.ls_offset = offset;
+	ls.ls_fileid = f->f_fileid;
+	ls.ls_pager = envs[1].env_id;
+	ls.ls_perm = PTE_V|PTE_LIBRARY;
+	if (prot & PROT_WRITE)
+		ls.ls_perm |= PTE_DTRACK;
+	if ((r = syscall_lazy_map(0, &ls)) < 0) {
+		syscall_mem_unmap(0, MMAPFD(i));
+		return r;
+	}
+
+	mmaptab[i].m_len = len;
+	mmaptab[i].m_fileid = f->f_fileid;
+	mmaptab[i].m_offset = offset;
+	mmaptab[i].m_ndata = ls.ls_fileend - va;
+	*addr = (void*)va;
+	return 0;
+}
+
+// Undo the mmap() that returned addr. Pages written through it are
+// reported to the file server, which must happen before the file is
+// closed for the writes to reach the disk.
+int
+munmap(void *addr)
+{
+	u_int va, i, off;
+	int n, r;
+
+	va = (u_int)addr;
+	n = (va - MMAPBASE) / FDDATASIZE;
+	if (va < MMAPBASE || n >= NMMAP || va != MMAPBASE + n*FDDATASIZE
+	||  mmaptab[n].m_len == 0)
+		return -E_INVAL;
+
+	syscall_lazy_unmap(0, va);
+	for (i = 0; i < mmaptab[n].m_len; i += BY2PG) {
+		if (!((* vpd)[PDX(va+i)] & PTE_V) || !((* vpt)[VPN(va+i)] & PTE_V))
+			continue;
+		off = mmaptab[n].m_offset + i;
+		if (i < mmaptab[n].m_ndata && ((* vpt)[VPN(va+i)] & PTE_D))
+			fsring_post(FSREQ_DIRTY, mmaptab[n].m_fileid, off, 0, off, 0);
+		if ((r = syscall_mem_unmap(0, va+i)) < 0)
+			return r;
+	}
+	fsring_flush();
+	if ((r = syscall_mem_unmap(0, MMAPFD(n))) < 0)
+		return r;
+	mmaptab[n].m_len = 0;
+	return 0;
+}
+
+// Have the kernel page in the first size bytes of the file open on fd
+// on first touch (see sys_lazy_map), instead of mapping them up front.
+// The pages share the file server's block cache, so writes reach it.
+// With every lazy region slot taken, the pages not mapped yet are mapped
+// up front instead.
+static int
+file_lazy_map(struct Fd *fd, u_int size)
+{
+	struct Lazyseg ls;
+	u_int va, i;
+	int r;
+
+	va = fd2data(fd);
+	if (size == 0)
+		return syscall_lazy_unmap(0, va);
+	ls.ls_va = va;
+	ls.ls_end = va + ROUND(size, BY2PG);
+	ls.ls_fileend = va + size;
+	ls.ls_offset = 0;
+	ls.ls_fileid = ((struct Filefd*)fd)->f_fileid;
+	ls.ls_pager = envs[1].env_id;
+	ls.ls_perm = PTE_V|PTE_DTRACK|PTE_LIBRARY;
+	if ((r = syscall_lazy_map(0, &ls)) != -E_NO_MEM)
+		return r;
+
+	for (i = 0; i < size; i += BY2PG)
+		if ((!((* vpd)[PDX(va+i)] & PTE_V) || !((* vpt)[VPN(va+i)] & PTE_V))
+		&&  (r = fsipc_map(ls.ls_fileid, i, va+i)) < 0)
+			return r;
+	return 0;
+}
@@ -202,7 +202,14 @@ fork(void)
 		//writef("vpt:%x, vpd:%x\n", *vpt, *vpd);
 		for(i = 0;i < PPN(USTACKTOP - BY2PG);)
 		{
-			if(!((u_long)(* vpd)[i>>10] & PTE_V))
+			// the fd table and file data are shared, not duplicated
+			if(i == PPN(FDTABLE))
+			{
+				if(fd_share(newenvid) < 0)
+					user_panic("fork: cannot share fds");
+				i = PPN(INDEX2DATA(MAXFD));
+			}
+			else if(!((u_long)(* vpd)[i>>10] & PTE_V))
 				i += 1024;
 			else
 			{
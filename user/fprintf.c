@@ -2,25 +2,37 @@
 
 
 
+// Where the next piece of a fwritef() goes, and the end of its buffer.
+struct Strbuf {
+	char *s_pos;
+	char *s_end;
+};
+
 static void user_out2string(void *arg, char *s, int l)
 {
     int i;
-	char * b = (char *)arg;
+	struct Strbuf *b = (struct Strbuf *)arg;
     // special termination call
     if ((l==1) && (s[0] == '\0')) return;
     
-    for (i=0; i< l; i++) {
-	b[i]=s[i];
+    for (i=0; i< l && b->s_pos < b->s_end; i++) {
+	*b->s_pos++ = s[i];
     }
 }
 
 
+// The whole output goes to fd in one write(), on the console a single
+// syscall_cputs() (see cons_write()).
 int fwritef(int fd, const char *fmt, ...)
 {
 	char buf[512];
+	struct Strbuf b;
 	va_list ap;
+
+	b.s_pos = buf;
+	b.s_end = buf + sizeof buf;
 	va_start(ap, fmt);
-	user_lp_Print(user_out2string, buf, fmt, ap);
+	user_lp_Print(user_out2string, &b, fmt, ap);
 	va_end(ap);
-	return write(fd, buf, strlen(buf));
+	return write(fd, buf, b.s_pos - buf);
 }
@@ -16,14 +16,16 @@ extern u_char fsipcbuf[BY2PG];		// page-aligned, declared in entry.S
 static int
 fsipc(u_int type, void *fsreq, u_int dstva, u_int *perm)
 {
-	u_int whom;
-	int r;
 	//we file system no. is 000000000000000000
-	ipc_send(envs[1].env_id, type, (u_int)fsreq, PTE_V|PTE_R);
-//	writef("fsipc:ending ipc send & recv dst:%x\n",dstva);
-	r =  ipc_recv(&whom, dstva, perm);
-//writef("fsipc:r = %d\n",r);
-	return r;
+	return ipc_call(envs[1].env_id, type, (u_int)fsreq, PTE_V|PTE_R, 0, dstva, perm);
+}
+
+// Like fsipc(), for requests that fit in IPC_MSGWORDS words: the kernel
+// copies them into the server's env_ipc_msg, so no page is mapped.
+static int
+fsipc_inline(u_int type, void *fsreq, u_int dstva, u_int *perm)
+{
+	return ipc_call(envs[1].env_id, type, 0, 0, fsreq, dstva, perm);
 }
 
 // Send file-open request to the file server.
@@ -61,13 +63,30 @@ fsipc_map(u_int fileid, u_int offset, u_int dstva)
 	req = (struct Fsreq_map*)fsipcbuf;
 	req->req_fileid = fileid;
 	req->req_offset = offset;
-	if ((r=fsipc(FSREQ_MAP, req, dstva, &perm)) < 0)
+	if ((r=fsipc_inline(FSREQ_MAP, req, dstva, &perm)) < 0)
 		return r;
-	if ((perm&~(PTE_R|PTE_LIBRARY)) != (PTE_V))
+	if ((perm&~(PTE_R|PTE_DTRACK|PTE_LIBRARY)) != (PTE_V))
 		user_panic("fsipc_map: unexpected permissions %08x for dstva %08x", perm, dstva);
 	return 0;
 }
 
+// Make a map-range request to the file server: it maps the blocks of
+// the file covering [offset, end) at dstva onwards, straight into our
+// address space, in a single round trip.
+// Returns 0 on success, < 0 on failure.
+int
+fsipc_map_range(u_int fileid, u_int offset, u_int end, u_int dstva)
+{
+	struct Fsreq_map_range *req;
+
+	req = (struct Fsreq_map_range*)fsipcbuf;
+	req->req_fileid = fileid;
+	req->req_offset = offset;
+	req->req_end = ROUND(end, BY2BLK);
+	req->req_va = dstva;
+	return fsipc_inline(FSREQ_MAP_RANGE, req, 0, 0);
+}
+
 // Make a set-file-size request to the file server.
 int
 fsipc_set_size(u_int fileid, u_int size)
@@ -77,7 +96,7 @@ fsipc_set_size(u_int fileid, u_int size)
 	req = (struct Fsreq_set_size*)fsipcbuf;
 	req->req_fileid = fileid;
 	req->req_size = size;
-	return fsipc(FSREQ_SET_SIZE, req, 0, 0);
+	return fsipc_inline(FSREQ_SET_SIZE, req, 0, 0);
 }
 
 // Make a file-close request to the file server.
@@ -89,7 +108,7 @@ fsipc_close(u_int fileid)
 
 	req = (struct Fsreq_close*)fsipcbuf;
 	req->req_fileid = fileid;
-	return fsipc(FSREQ_CLOSE, req, 0, 0);
+	return fsipc_inline(FSREQ_CLOSE, req, 0, 0);
 }
 
 // Ask the file server to mark a particular file block dirty.
@@ -101,7 +120,7 @@ fsipc_dirty(u_int fileid, u_int offset)
 	req = (struct Fsreq_dirty*)fsipcbuf;
 	req->req_fileid = fileid;
 	req->req_offset = offset;
-	return fsipc(FSREQ_DIRTY, req, 0, 0);
+	return fsipc_inline(FSREQ_DIRTY, req, 0, 0);
 }
 
 // Ask the file server to delete a file, given its pathname.
@@ -122,6 +141,124 @@ fsipc_remove(const char *path)
 int
 fsipc_sync(void)
 {
-	return fsipc(FSREQ_SYNC, fsipcbuf, 0, 0);
+	return fsipc_inline(FSREQ_SYNC, fsipcbuf, 0, 0);
 }
 
+
+// Submission/completion rings shared with the file server (see fs.h).
+// Requests are posted with fsring_post() and handed to the server in
+// batches by fsring_enter(); each enter is a single IPC round trip.
+
+#define FSRING_SQVA	(FDTABLE-3*BY2PG)
+#define FSRING_CQVA	(FDTABLE-2*BY2PG)
+
+static struct Fsring_sq *fsring_sq = (struct Fsring_sq*)FSRING_SQVA;
+static struct Fsring_cq *fsring_cq = (struct Fsring_cq*)FSRING_CQVA;
+static u_int fsring_owner;	// env whose rings are registered, 0 if none
+static u_int fsring_npath;	// path slots used since the last enter
+
+// Set up our rings with the file server, unless done already.
+// A child of fork() inherits the parent's ring pages and must not post
+// to them, so it gets fresh ones.
+static int
+fsring_setup(void)
+{
+	struct Fsreq_ring *req;
+	int r;
+
+	if (fsring_owner == env->env_id)
+		return 0;
+	if ((r = syscall_mem_alloc(0, FSRING_SQVA, PTE_V|PTE_R|PTE_LIBRARY)) < 0
+	||  (r = syscall_mem_alloc(0, FSRING_CQVA, PTE_V|PTE_R|PTE_LIBRARY)) < 0)
+		return r;
+
+	req = (struct Fsreq_ring*)fsipcbuf;
+	req->req_sqva = FSRING_SQVA;
+	req->req_cqva = FSRING_CQVA;
+	if ((r = fsipc_inline(FSREQ_RING, req, 0, 0)) < 0)
+		return r;
+	fsring_owner = env->env_id;
+	fsring_npath = 0;
+	return 0;
+}
+
+// Queue a request on the submission ring; path is only used by
+// FSREQ_REMOVE. If the ring (or the path slots) are full, the pending
+// requests are handed over and their completions reaped first.
+// Returns 0 on success, < 0 on failure (including a failed request
+// completed on the way).
+int
+fsring_post(u_int type, u_int fileid, u_int arg, u_int va, u_int data, const char *path)
+{
+	struct Fsring_sqe *sqe;
+	int r;
+
+	if ((r = fsring_setup()) < 0)
+		return r;
+	if (fsring_sq->sq_tail - fsring_sq->sq_head == NFSRING_ENT
+	||  (path && fsring_npath == NFSRING_PATH))
+		if ((r = fsring_flush()) < 0)
+			return r;
+
+	if (path) {
+		if (strlen(path) >= MAXPATHLEN)
+			return -E_BAD_PATH;
+		strcpy(fsring_sq->sq_path[fsring_npath], path);
+		arg = fsring_npath++;
+	}
+	sqe = &fsring_sq->sq_ent[fsring_sq->sq_tail % NFSRING_ENT];
+	sqe->sqe_type = type;
+	sqe->sqe_fileid = fileid;
+	sqe->sqe_arg = arg;
+	sqe->sqe_va = va;
+	sqe->sqe_data = data;
+	fsring_sq->sq_tail++;
+	return 0;
+}
+
+// Hand the posted requests to the file server in one IPC.
+// Returns the number of completions it posted, < 0 on failure.
+int
+fsring_enter(void)
+{
+	int r;
+
+	if ((r = fsring_setup()) < 0)
+		return r;
+	if ((r = fsipc_inline(FSREQ_RING_ENTER, fsipcbuf, 0, 0)) >= 0)
+		fsring_npath = 0;
+	return r;
+}
+
+// Take the oldest completion off the completion ring.
+// Returns 1 and fills *cqe if there was one, 0 if the ring is empty.
+int
+fsring_reap(struct Fsring_cqe *cqe)
+{
+	if (fsring_owner != env->env_id
+	||  fsring_cq->cq_head == fsring_cq->cq_tail)
+		return 0;
+	*cqe = fsring_cq->cq_ent[fsring_cq->cq_head % NFSRING_ENT];
+	fsring_cq->cq_head++;
+	return 1;
+}
+
+// Enter until every posted request has completed, reaping as we go.
+// Returns 0 if all of them succeeded, otherwise the first error.
+int
+fsring_flush(void)
+{
+	struct Fsring_cqe cqe;
+	int r, err;
+
+	err = 0;
+	while (fsring_owner == env->env_id
+	&&  fsring_sq->sq_head != fsring_sq->sq_tail) {
+		if ((r = fsring_enter()) < 0)
+			return r;
+		while (fsring_reap(&cqe))
+			if (cqe.cqe_res < 0 && err == 0)
+				err = cqe.cqe_res;
+	}
+	return err;
+}
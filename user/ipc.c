@@ -5,22 +5,14 @@
 
 extern struct Env *env;
 
-// Send val to whom.  This function keeps trying until
-// it succeeds.  It should panic() on any error other than
-// -E_IPC_NOT_RECV.  
-//
-// Hint: use syscall_yield() to be CPU-friendly.
+// Send val to whom.  The kernel blocks us in whom's queue of
+// senders until it receives.  It should panic() on any error.
 void
 ipc_send(u_int whom, u_int val, u_int srcva, u_int perm)
 {
 	int r;
 
-	while ((r=syscall_ipc_can_send(whom, val, srcva, perm)) == -E_IPC_NOT_RECV)
-	{
-		syscall_yield();
-		//writef("QQ");
-	}
-	if(r == 0)
+	if ((r=syscall_ipc_send(whom, val, srcva, perm, 0)) == 0)
 		return;
 	user_panic("error in ipc_send: %d", r);
 }
@@ -42,3 +34,37 @@ ipc_recv(u_int *whom, u_int dstva, u_int *perm)
 	return env->env_ipc_value;
 }
 
+
+// Send a request to whom and wait for its reply, in one system call.
+// msg, if not 0, points to IPC_MSGWORDS words the kernel copies into
+// the receiver's env_ipc_msg; small requests need no page at all.
+// Return the reply value; the reply page, if any, is mapped at dstva
+// and its permissions stored in *rperm.
+u_int
+ipc_call(u_int whom, u_int val, u_int srcva, u_int perm, const void *msg,
+	u_int dstva, u_int *rperm)
+{
+	int r;
+
+	if ((r=syscall_ipc_call(whom, val, srcva, perm, dstva, msg)) < 0)
+		user_panic("error in ipc_call: %d", r);
+	if (rperm)
+		*rperm = env->env_ipc_perm;
+	return env->env_ipc_value;
+}
+
+// Server loop step: reply val to the client 'to' (no reply if 'to' is 0)
+// and receive the next request, in one system call.  A client that
+// is no longer waiting just misses its reply.
+// Return the request value and store the sender in *whom.
+u_int
+ipc_reply_wait(u_int to, u_int val, u_int srcva, u_int perm, const void *msg,
+	u_int *whom, u_int dstva, u_int *rperm)
+{
+	syscall_ipc_reply_wait(to, val, srcva, perm, dstva, msg);
+	if (whom)
+		*whom = env->env_ipc_from;
+	if (rperm)
+		*rperm = env->env_ipc_perm;
+	return env->env_ipc_value;
+}
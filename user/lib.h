@@ -51,23 +51,42 @@ void syscall_putchar(char ch);
  int syscall_set_env_status(u_int envid, u_int status);
  int syscall_set_trapframe(u_int envid, struct Trapframe *tf);
  void syscall_panic(char *msg);
+ int syscall_lazy_map(u_int envid, struct Lazyseg *seg);
+ int syscall_lazy_unmap(u_int envid, u_int va);
+ int syscall_wait_on(u_int va, u_int expected);
+ int syscall_wake(u_int va, int n);
+ int syscall_ipc_can_send(u_int envid, u_int value, u_int srcva, u_int perm);
+ int syscall_ipc_send(u_int envid, u_int value, u_int srcva, u_int perm, const void *msg);
+ int syscall_ipc_call(u_int envid, u_int value, u_int srcva, u_int perm, u_int dstva, const void *msg);
+ int syscall_ipc_reply_wait(u_int envid, u_int value, u_int srcva, u_int perm, u_int dstva, const void *msg);
+ int syscall_cputs(const char *buf, u_int len);
 
 // ipc.c
 void	ipc_send(u_int whom, u_int val, u_int srcva, u_int perm);
 u_int	ipc_recv(u_int *whom, u_int dstva, u_int *perm);
+u_int	ipc_call(u_int whom, u_int val, u_int srcva, u_int perm, const void *msg, u_int dstva, u_int *rperm);
+u_int	ipc_reply_wait(u_int to, u_int val, u_int srcva, u_int perm, const void *msg, u_int *whom, u_int dstva, u_int *rperm);
 
 // pageref.c
 int	pageref(void*);
 
+// wait.c
+void	wait(u_int envid);
+
 // fsipc.c
 int	fsipc_open(const char*, u_int, struct Fd*);
 int	fsipc_map(u_int, u_int, u_int);
+int	fsipc_map_range(u_int, u_int, u_int, u_int);
 int	fsipc_set_size(u_int, u_int);
 int	fsipc_close(u_int);
 int	fsipc_dirty(u_int, u_int);
 int	fsipc_remove(const char*);
 int	fsipc_sync(void);
 int	fsipc_incref(u_int);
+int	fsring_post(u_int, u_int, u_int, u_int, u_int, const char*);
+int	fsring_enter(void);
+int	fsring_reap(struct Fsring_cqe*);
+int	fsring_flush(void);
 
 // fd.c
 int	close(int fd);
@@ -77,6 +96,7 @@ int	seek(int fd, u_int offset);
 void	close_all(void);
 int	readn(int fd, void *buf, u_int nbytes);
 int	dup(int oldfd, int newfd);
+int	sendfile(int outfd, int infd, u_int offset, u_int nbytes);
 int fstat(int fdnum, struct Stat *stat);
 int	stat(const char *path, struct Stat*);
 
@@ -86,6 +106,8 @@ int	read_map(int fd, u_int offset, void **blk);
 int	delete(const char *path);
 int	ftruncate(int fd, u_int size);
 int	sync(void);
+int	mmap(int fd, u_int offset, u_int len, int prot, void **addr);
+int	munmap(void *addr);
 
 #define user_assert(x)	\
 	do {	if (!(x)) user_panic("assertion failed: %s", #x); } while (0)
@@ -101,5 +123,9 @@ int	sync(void);
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
 
+/* mmap protections */
+#define	PROT_READ	0x1		/* pages may be read */
+#define	PROT_WRITE	0x2		/* pages may be written */
+
 
 #endif
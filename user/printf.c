@@ -7,36 +7,61 @@
 
 void halt(void);
 
+// Output of a writef(), gathered so it reaches the console in a few
+// syscall_cputs() rather than a syscall per character.
+struct Outbuf {
+    int n;
+    char buf[128];
+};
+
 static void user_myoutput(void *arg, char *s, int l)
 {
+    struct Outbuf *ob = (struct Outbuf *)arg;
     int i;
 
     // special termination call
     if ((l==1) && (s[0] == '\0')) return;
     
     for (i=0; i< l; i++) {
-	syscall_putchar(s[i]);
-	if (s[i] == '\n') syscall_putchar('\n');
+	if (ob->n == sizeof ob->buf) {
+	    syscall_cputs(ob->buf, ob->n);
+	    ob->n = 0;
+	}
+	ob->buf[ob->n++] = s[i];
     }
 }
 
+static void user_myflush(struct Outbuf *ob)
+{
+    if (ob->n)
+	syscall_cputs(ob->buf, ob->n);
+    ob->n = 0;
+}
+
 void writef(char *fmt, ...)
 {
+    struct Outbuf ob;
     va_list ap;
+
+    ob.n = 0;
     va_start(ap, fmt);
-    user_lp_Print(user_myoutput, 0, fmt, ap);
+    user_lp_Print(user_myoutput, &ob, fmt, ap);
     va_end(ap);
+    user_myflush(&ob);
 }
 
 void
 _user_panic(const char *file, int line, const char *fmt,...)
 {
+	struct Outbuf ob;
 	va_list ap;
 
 
+	ob.n = 0;
 	va_start(ap, fmt);
 	writef("panic at %s:%d: ", file, line);
-	user_lp_Print(user_myoutput, 0, (char *)fmt, ap);
+	user_lp_Print(user_myoutput, &ob, (char *)fmt, ap);
+	user_myflush(&ob);
 	writef("\n");
 	va_end(ap);
 
@@ -1,10 +1,15 @@
 #include "lib.h"
 #include <mmu.h>
 #include <env.h>
+#include <kerelf.h>
 
 #define TMPPAGE		(BY2PG)
 #define TMPPAGETOP	(TMPPAGE+BY2PG)
 
+/// Where the child keeps the Filefd page of its executable: just below
+/// the fd table, so that close_all() leaves it alone.
+#define EXECFD		(FDTABLE-BY2PG)
+
 int
 init_stack(u_int child, char **argv, u_int *init_esp)
 {
@@ -96,92 +101,119 @@ error:
 }
 
 
+/* Check the ELF magic and that the program header table lies in the
+ * first page of the file, which is all spawn() looks at.
+ */
+static int
+elf_check(Elf32_Ehdr *ehdr)
+{
+	return ehdr->e_ident[EI_MAG0] == ELFMAG0 &&
+		ehdr->e_ident[EI_MAG1] == ELFMAG1 &&
+		ehdr->e_ident[EI_MAG2] == ELFMAG2 &&
+		ehdr->e_ident[EI_MAG3] == ELFMAG3 &&
+		ehdr->e_phoff + ehdr->e_phnum * ehdr->e_phentsize <= BY2PG;
+}
+
+/* Register a PT_LOAD segment as a lazily-paged region of the child.
+ * Nothing is read here: the kernel asks the file server for each page
+ * the first time the child touches it, and zero-fills the bss.
+ *
+ * File offset and address must be congruent modulo BY2PG so that every
+ * child page is backed by exactly one file block (user.lds keeps them so).
+ */
+static int
+map_segment(u_int child, u_int fileid, Elf32_Phdr *ph)
+{
+	struct Lazyseg ls;
+
+	if ((ph->p_vaddr - ph->p_offset) % BY2PG)
+		return -E_NOT_EXEC;
+
+	ls.ls_va = ROUNDDOWN(ph->p_vaddr, BY2PG);
+	ls.ls_end = ROUND(ph->p_vaddr + ph->p_memsz, BY2PG);
+	ls.ls_fileend = ph->p_vaddr + ph->p_filesz;
+	ls.ls_offset = ph->p_offset - (ph->p_vaddr - ls.ls_va);
+	ls.ls_fileid = fileid;
+	ls.ls_pager = envs[1].env_id;
+	ls.ls_perm = (ph->p_flags & PF_W) ? PTE_V|PTE_R : PTE_V;
+	return syscall_lazy_map(child, &ls);
+}
+
 int spawn(char *prog, char **argv)
 {
-		int fd;
-		int r;
-		int size;
-		u_int esp;
-
-		if((fd = open(prog, O_RDWR/*O_ACCMODE*/))<0)
-			user_panic("spawn:open %s:%e",prog,fd);
-
-		writef("spawn open %s\n", prog);
-		u_int child_envid;
-		child_envid = syscall_env_alloc();
-		writef("spawn syscall_env_alloc\n");
-		if(child_envid < 0)
-		{
-			writef("spawn:alloc the new env is wrong\n");
-			return child_envid;
-		}
+	int fd, r, i;
+	u_int child_envid, esp;
+	void *blk;
+	Elf32_Ehdr *ehdr;
+	Elf32_Phdr *ph;
+	struct Filefd *ffd;
+	struct Lazyseg *ls;
+	struct Trapframe *tf;
 
-	init_stack(child_envid, argv,&esp);
+	if ((fd = open(prog, O_RDONLY)) < 0)
+		return fd;
+	writef("spawn open %s\n", prog);
 
-	size = ((struct Filefd*)num2fd(fd))->f_file.f_size;
-	writef("f_size:0x%x\n", size);
+	if ((r = read_map(fd, 0, &blk)) < 0)
+		goto err;
+	ehdr = blk;
+	if (!elf_check(ehdr)) {
+		r = -E_NOT_EXEC;
+		goto err;
+	}
+	ffd = (struct Filefd*)num2fd(fd);
+
+	if ((r = syscall_env_alloc()) < 0)
+		goto err;
+	child_envid = r;
+	if ((r = init_stack(child_envid, argv, &esp)) < 0)
+		goto err_child;
+
+	// the child inherited the regions of our own image; drop them,
+	// but keep those of open files, whose fds it shares
+	for (i = 0; i < NLAZYSEG; i++) {
+		ls = &envs[ENVX(child_envid)].env_lazyseg[i];
+		if (ls->ls_end && ls->ls_va < FDTABLE
+		&&  (r = syscall_lazy_unmap(child_envid, ls->ls_va)) < 0)
+			goto err_child;
+	}
 
-		
-		u_int i;
-		u_int *blk;
-		int text_start;
-		text_start = 0;
-		for(i = 0x1000; i < size; i += BY2PG)
-		{
-			if((r = read_map(fd, i, &blk))<0)
-			{
-				writef("mapping text region is wrong\n");
-				return r;
-			}
-
-			syscall_mem_map(0, blk, child_envid, UTEXT+text_start, PTE_V |PTE_R);		
-			writef("child_va:0x%x\n", UTEXT+text_start);
-			text_start += BY2PG;
-		}
+	ph = (Elf32_Phdr*)((u_char*)ehdr + ehdr->e_phoff);
+	for (i = 0; i < ehdr->e_phnum; i++) {
+		if (ph->p_type == PT_LOAD
+		&&  (r = map_segment(child_envid, ffd->f_fileid, ph)) < 0)
+			goto err_child;
+		ph = (Elf32_Phdr*)((u_char*)ph + ehdr->e_phentsize);
+	}
 
-	struct Trapframe *tf;
-		writef("\n::::::::::spawn size : %x  sp : %x::::::::\n",size,esp);
-		tf = &(envs[ENVX(child_envid)].env_tf);
-		tf->pc = UTEXT;
-		tf->regs[29]=esp;
-
-
-		u_int pdeno = 0;
-		u_int pteno = 0;
-		u_int pn = 0;
-		u_int va = 0;
-//writef("spawn begin to share \n");
-		for(pdeno = 0;pdeno<PDX(UTOP);pdeno++)
-		{
-			if(!((* vpd)[pdeno]&PTE_V))
-				continue;
-			for(pteno = 0;pteno<=PTX(~0);pteno++)
-			{
-				pn = (pdeno<<10)+pteno;
-				if(((* vpt)[pn]&PTE_V)&&((* vpt)[pn]&PTE_LIBRARY))
-				{
-					va = pn*BY2PG;
-
-					if((r = syscall_mem_map(0,va,child_envid,va,(PTE_V|PTE_R|PTE_LIBRARY)))<0)
-					{
-
-						writef("va: %x   child_envid: %x   \n",va,child_envid);
-						user_panic("@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-						return r;
-					}
-				}
-			}
-		}
-	
-	
-		if((r = syscall_set_env_status(child_envid, ENV_RUNNABLE)) < 0)
-		{
-			writef("set child runnable is wrong\n");
-			return r;
-		}
-//writef("spawn:end of spawn\n");		
-		return child_envid;		
+	// the child holds the executable open for as long as it pages from it
+	if ((r = syscall_mem_map(0, (u_int)ffd, child_envid, EXECFD, PTE_V|PTE_R|PTE_LIBRARY)) < 0)
+		goto err_child;
+
+	tf = &(envs[ENVX(child_envid)].env_tf);
+	tf->pc = ehdr->e_entry;
+	tf->regs[29] = esp;
+	close(fd);
 
+	if ((r = fd_share(child_envid)) < 0)
+	{
+		writef("spawn: cannot share fds with %x: %e\n", child_envid, r);
+		syscall_env_destroy(child_envid);
+		return r;
+	}
+
+	if((r = syscall_set_env_status(child_envid, ENV_RUNNABLE)) < 0)
+	{
+		writef("set child runnable is wrong\n");
+		return r;
+	}
+	return child_envid;
+
+err_child:
+	syscall_env_destroy(child_envid);
+err:
+	close(fd);
+	return r;
 }
 
 int
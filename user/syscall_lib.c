@@ -83,7 +83,7 @@ syscall_panic(char *msg)
 int
 syscall_ipc_can_send(u_int envid, u_int value, u_int srcva, u_int perm)
 {
-	return msyscall(SYS_ipc_can_send, envid, value, srcva, perm, 0);
+	return msyscall(SYS_ipc_can_send, envid, value, srcva, perm, 0, 0);
 }
 
 void
@@ -97,3 +97,53 @@ syscall_cgetc()
 {
 	return msyscall(SYS_cgetc,0,0,0,0,0);
 }
+
+int
+syscall_lazy_map(u_int envid, struct Lazyseg *seg)
+{
+	return msyscall(SYS_lazy_map, envid, (u_int)seg, 0, 0, 0);
+}
+
+int
+syscall_lazy_unmap(u_int envid, u_int va)
+{
+	return msyscall(SYS_lazy_unmap, envid, va, 0, 0, 0);
+}
+
+int
+syscall_wait_on(u_int va, u_int expected)
+{
+	return msyscall(SYS_wait_on, va, expected, 0, 0, 0);
+}
+
+int
+syscall_wake(u_int va, int n)
+{
+	return msyscall(SYS_wake, va, n, 0, 0, 0);
+}
+
+int
+syscall_cputs(const char *buf, u_int len)
+{
+	return msyscall(SYS_cputs, (u_int)buf, len, 0, 0, 0);
+}
+
+int
+syscall_ipc_send(u_int envid, u_int value, u_int srcva, u_int perm, const void *msg)
+{
+	return msyscall(SYS_ipc_send, envid, value, srcva, perm, (u_int)msg, 0);
+}
+
+int
+syscall_ipc_call(u_int envid, u_int value, u_int srcva, u_int perm, u_int dstva,
+	const void *msg)
+{
+	return msyscall(SYS_ipc_call, envid, value, srcva, perm, dstva, (u_int)msg);
+}
+
+int
+syscall_ipc_reply_wait(u_int envid, u_int value, u_int srcva, u_int perm, u_int dstva,
+	const void *msg)
+{
+	return msyscall(SYS_ipc_reply_wait, envid, value, srcva, perm, dstva, (u_int)msg);
+}
@@ -3,11 +3,15 @@
 
 char *msg = "Now is the time for all good men to come to the aid of their party.";
 
+#define NTHRU	(64*1024)
+char thrubuf[1024];
+
 void
 umain(void)
 {
 	char buf[100];
-	int i, pid, p[2];
+	int i, n, pid, p[2];
+	u_int runs;
 
 	if ((i=pipe(p)) < 0)
 		user_panic("pipe: %e", i);
@@ -58,5 +62,32 @@ umain(void)
 	close(p[1]);
 	wait(pid);
 
+	// throughput: push NTHRU bytes through a pipe in 1K writes
+	if ((i=pipe(p)) < 0)
+		user_panic("pipe: %e", i);
+
+	if ((pid=fork()) < 0)
+		user_panic("fork: %e", i);
+
+	if (pid == 0) {
+		close(p[0]);
+		for (n = 0; n < NTHRU; n += sizeof thrubuf)
+			if ((i=write(p[1], thrubuf, sizeof thrubuf)) != sizeof thrubuf)
+				user_panic("write: %e", i);
+		exit();
+	}
+	close(p[1]);
+	runs = env->env_runs;
+	for (n = 0; (i=read(p[0], thrubuf, sizeof thrubuf)) > 0; n += i)
+		;
+	if (i < 0)
+		user_panic("read: %e", i);
+	runs = env->env_runs - runs;
+	close(p[0]);
+	wait(pid);
+	if (n != NTHRU)
+		user_panic("pipe throughput: read %d of %d bytes", n, NTHRU);
+	writef("pipe throughput: %d bytes in %d runs of the reader\n", n, runs);
+
 	writef("pipe tests passed\n");
 }
@@ -1,10 +1,32 @@
 #include "lib.h"
 
+#define NSPAWN	8
+
+// Spawn latency against the number of open fds, counted in the
+// scheduling rounds (env_runs) the parent spends inside spawn().
 void umain(int argc, char **argv)
 {
-	char a[]={"testfdsharing.Y"};
+	char a[]={"testarg.b"};
 	char *s1[]={{"hello!"},{"world!"},{"haha"},{NULL}};
-	
-	spawn(a, s1);
+	int i, r, nfd, child;
+	u_int runs, t;
+
+	nfd = 0;
+	for (;;) {
+		runs = 0;
+		for (i = 0; i < NSPAWN; i++) {
+			t = env->env_runs;
+			if ((child = spawn(a, s1)) < 0)
+				user_panic("spawn %s: %e", a, child);
+			runs += env->env_runs - t;
+			wait(child);
+		}
+		writef("testspawn: %d fds open, %d runs per %d spawns\n", nfd, runs, NSPAWN);
 
+		if (nfd >= MAXFD - 2)
+			break;
+		for (i = 0; i < 8 && nfd < MAXFD - 2; i++, nfd++)
+			if ((r = open("motd", O_RDONLY)) < 0)
+				user_panic("open motd: %e", r);
+	}
 }
@@ -4,11 +4,13 @@ void
 wait(u_int envid)
 {
 	struct Env *e;
+	u_int status;
 
 	//writef("envid:%x  wait()~~~~~~~~~",envid);
+	// the kernel wakes sleepers on env_status when it frees the env
 	e = &envs[ENVX(envid)];
-	while(e->env_id == envid && e->env_status != ENV_FREE)
-		syscall_yield();
+	while(e->env_id == envid && (status = e->env_status) != ENV_FREE)
+		syscall_wait_on((u_int)&e->env_status, status);
 }
 
 